@@ -0,0 +1,72 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool config_open(struct config_file *c, const char *tool) {
+  const char *home = getenv("HOME");
+  if (!home)
+    return false;
+
+  snprintf(c->path, sizeof(c->path), "%s/.config/%s/config", home, tool);
+  c->f = fopen(c->path, "r");
+  c->lineno = 0;
+  return c->f != NULL;
+}
+
+const char *config_next(struct config_file *c) {
+  while (fgets(c->line, sizeof(c->line), c->f)) {
+    c->lineno++;
+
+    /* strip trailing newline */
+    size_t len = strlen(c->line);
+    while (len > 0 && (c->line[len - 1] == '\n' || c->line[len - 1] == '\r'))
+      c->line[--len] = '\0';
+
+    /* skip blank lines and comments */
+    const char *p = c->line;
+    config_skip_blanks(&p);
+    if (*p != '\0' && *p != '#')
+      return p;
+  }
+
+  fclose(c->f);
+  c->f = NULL;
+  return NULL;
+}
+
+void config_skip_blanks(const char **p) {
+  while (**p == ' ' || **p == '\t')
+    (*p)++;
+}
+
+char *config_quoted(const char **p) {
+  if (**p != '"')
+    return NULL;
+  (*p)++; /* skip opening quote */
+
+  size_t cap = 64, len = 0;
+  char *buf = malloc(cap);
+  if (!buf)
+    return NULL;
+
+  while (**p && **p != '"') {
+    if (**p == '\\' && *(*p + 1) == '"')
+      (*p)++; /* skip backslash */
+    if (len + 1 >= cap) {
+      cap *= 2;
+      char *tmp = realloc(buf, cap);
+      if (!tmp) {
+        free(buf);
+        return NULL;
+      }
+      buf = tmp;
+    }
+    buf[len++] = **p;
+    (*p)++;
+  }
+  if (**p == '"')
+    (*p)++;
+  buf[len] = '\0';
+  return buf;
+}
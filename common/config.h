@@ -0,0 +1,32 @@
+/*
+ * Reader for the tools' line based config files in ~/.config/<tool>/config:
+ * '#' comments, blank lines, [section] headers and key = value lines, with
+ * "quoted" strings that may contain \" escapes. The syntax of the sections
+ * and lines is up to the tools.
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+struct config_file {
+  FILE *f;
+  char path[512];
+  int lineno;
+  char line[1024];
+};
+
+/* Opens ~/.config/<tool>/config, returns false if there is none */
+bool config_open(struct config_file *c, const char *tool);
+/*
+ * Returns the next line that isn't blank or a comment, without its leading
+ * blanks and newline. Closes the file and returns NULL at its end.
+ */
+const char *config_next(struct config_file *c);
+
+void config_skip_blanks(const char **p);
+/* Parses a quoted string at *p and moves past it, NULL if *p isn't a quote */
+char *config_quoted(const char **p);
+
+#endif
@@ -0,0 +1,82 @@
+#include "evloop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 16
+
+int evloop_init(struct evloop *l) {
+  *l = (struct evloop){0};
+  l->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (l->epfd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+  return 0;
+}
+
+int evloop_add(struct evloop *l, struct evloop_source *s, int fd,
+               void (*fn)(void *data), void *data) {
+  *s = (struct evloop_source){.fd = fd, .fn = fn, .data = data};
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+  if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  s->active = true;
+  return 0;
+}
+
+void evloop_remove(struct evloop *l, struct evloop_source *s) {
+  if (!s->active)
+    return;
+  epoll_ctl(l->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+  s->active = false;
+}
+
+int evloop_add_hook(struct evloop *l, int (*fn)(void *data), void *data) {
+  if (l->n_hooks == EVLOOP_MAX_HOOKS) {
+    fprintf(stderr, "Too many event loop hooks\n");
+    return -1;
+  }
+  l->hooks[l->n_hooks++] = (struct evloop_hook){fn, data};
+  return 0;
+}
+
+void evloop_quit(struct evloop *l, int status) {
+  l->quit = true;
+  l->status = status;
+}
+
+int evloop_run(struct evloop *l) {
+  struct epoll_event events[MAX_EVENTS];
+
+  while (!l->quit) {
+    int timeout = -1;
+    for (int i = 0; i < l->n_hooks && !l->quit; i++) {
+      int ms = l->hooks[i].fn(l->hooks[i].data);
+      if (ms >= 0 && (timeout < 0 || ms < timeout))
+        timeout = ms;
+    }
+    if (l->quit)
+      break;
+
+    int n = epoll_wait(l->epfd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      return 1;
+    }
+
+    for (int i = 0; i < n && !l->quit; i++) {
+      struct evloop_source *s = events[i].data.ptr;
+      /* removed (and maybe re-added) by an earlier callback of this batch */
+      if (s->active)
+        s->fn(s->data);
+    }
+  }
+  return l->status;
+}
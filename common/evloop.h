@@ -0,0 +1,53 @@
+/*
+ * Single-threaded epoll loop shared by the tools, so that the same module
+ * code runs as a standalone binary or next to other modules in
+ * desktop-eventd.
+ *
+ * Sources are owned by the modules and stay registered until removed. Before
+ * every wait the hooks run: they handle input that libraries already read
+ * into their own buffers (D-Bus, Xlib), and can shorten the wait for their
+ * own timeouts.
+ */
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdbool.h>
+
+#define EVLOOP_MAX_HOOKS 16
+
+struct evloop_source {
+  int fd;
+  bool active; /* registered with the loop */
+  void (*fn)(void *data);
+  void *data;
+};
+
+struct evloop_hook {
+  /* returns the time in ms until it has to run again, -1 for no limit */
+  int (*fn)(void *data);
+  void *data;
+};
+
+struct evloop {
+  int epfd;
+  bool quit;
+  int status;
+  struct evloop_hook hooks[EVLOOP_MAX_HOOKS];
+  int n_hooks;
+};
+
+int evloop_init(struct evloop *l);
+/*
+ * Calls fn(data) while fd is readable. fn may now and then be called for an
+ * fd that isn't, so it has to be nonblocking.
+ */
+int evloop_add(struct evloop *l, struct evloop_source *s, int fd,
+               void (*fn)(void *data), void *data);
+/* Must be called before the fd is closed; a no-op if s isn't registered */
+void evloop_remove(struct evloop *l, struct evloop_source *s);
+int evloop_add_hook(struct evloop *l, int (*fn)(void *data), void *data);
+/* Runs until evloop_quit(), returns its status */
+int evloop_run(struct evloop *l);
+void evloop_quit(struct evloop *l, int status);
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * Trace events of all tools, in one table so that trace-decode can print any
+ * trace. Append only: the position in the table is the id stored in traces.
+ *
+ * X(id, name, arg0 name, arg0 kind, arg1 name, arg1 kind)
+ * Kinds: 'u' unsigned, 'd' signed, 'x' hex, 's' trace_str() string, 0 unused.
+ */
+#define TRACE_EVENTS(X)                                                        \
+  /* micro-locker */                                                           \
+  X(ML_LISTEN, "ml.listen", "pid", 'd', NULL, 0)                               \
+  X(ML_MATCH, "ml.match", "rule", 's', NULL, 0)                                \
+  X(ML_DISPATCH, "ml.dispatch", "event", 's', "dt_us", 'u')                    \
+  X(ML_EXEC, "ml.exec", "event", 's', "pid", 'd')                              \
+  X(ML_SKIP, "ml.skip", "event", 's', "reason", 's')                           \
+  X(ML_KILL, "ml.kill", "event", 's', "pid", 'd')                              \
+  X(ML_EXIT, "ml.exit", "pid", 'd', "status", 'x')                             \
+  /* input hotplug watchers */                                                 \
+  X(HP_XEVENT, "hp.xevent", "type", 'u', NULL, 0)                              \
+  X(HP_XI_INFO, "hp.xi_info", "device", 'd', "flags", 'x')                     \
+  X(HP_UEVENT, "hp.uevent", "device", 'd', "action", 's')                      \
+  X(HP_DEVICE, "hp.device", "device", 'd', "present", 'u')                     \
+  X(HP_DEBOUNCE, "hp.debounce", "window_us", 'u', NULL, 0)                     \
+  X(HP_DEBOUNCED, "hp.debounced", "events", 'u', "dt_us", 'u')                 \
+  X(HP_NARROW, "hp.narrow", "kept", 'u', "skipped", 'u')                       \
+  X(HP_UNCHANGED, "hp.unchanged", NULL, 0, NULL, 0)                            \
+  X(HP_APPLY, "hp.apply", "device", 'd', "name", 's')                          \
+  X(HP_RUN, "hp.run", "pid", 'd', "devices", 'u')                              \
+  X(HP_RERUN, "hp.rerun", "pid", 'd', NULL, 0)                                 \
+  X(HP_EXIT, "hp.exit", "pid", 'd', "status", 'x')                             \
+  X(HP_CONNECT, "hp.connect", "display", 's', NULL, 0)                         \
+  X(HP_DISCONNECT, "hp.disconnect", "display", 's', NULL, 0)                   \
+  /* pwtool */                                                                 \
+  X(PW_CONFIG, "pw.config", "path", 's', NULL, 0)                              \
+  X(PW_MAP, "pw.map", "from", 's', "to", 's')                                  \
+  X(PW_NODE_ADD, "pw.node_add", "id", 'u', "name", 's')                        \
+  X(PW_NODE_REMOVE, "pw.node_remove", "id", 'u', "name", 's')                  \
+  X(PW_SUBSCRIBE, "pw.subscribe", "id", 'u', "name", 's')                      \
+  X(PW_METADATA, "pw.metadata", "id", 'u', NULL, 0)                            \
+  X(PW_DEFAULT, "pw.default", "kind", 's', "name", 's')                        \
+  X(PW_MUTE, "pw.mute", "id", 'u', "muted", 'u')                               \
+  X(PW_SYNC, "pw.sync", NULL, 0, NULL, 0)                                      \
+  /* desktop-eventd */                                                         \
+  X(EVD_MODULE, "evd.module", "name", 's', "start_us", 'u')
@@ -0,0 +1,175 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+const struct trace_event_info trace_events[TRACE_N_EVENTS] = {
+#define X(id, name, a0, k0, a1, k1) [TRACE_##id] = {name, {a0, a1}, {k0, k1}},
+    TRACE_EVENTS(X)
+#undef X
+};
+
+struct trace_header *trace_ring;
+
+_Static_assert(sizeof(struct trace_record) == 32, "records are 32 bytes");
+
+void trace_init(const char *name) {
+  const char *dir = getenv("TRACE_DIR");
+  if (!dir || !*dir)
+    return;
+
+  uint32_t capacity = TRACE_DEFAULT_RECORDS;
+  const char *records = getenv("TRACE_RECORDS");
+  if (records && strtoul(records, NULL, 10) > 0) {
+    unsigned long want = strtoul(records, NULL, 10);
+    for (capacity = 1; capacity < want && capacity < (1u << 24); capacity <<= 1)
+      ;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s.%d", dir, name, getpid());
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror(path);
+    return;
+  }
+
+  size_t size = sizeof(struct trace_header) +
+                (size_t)capacity * sizeof(struct trace_record);
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return;
+  }
+
+  /* a fresh file is all zeroes, the magic goes last */
+  struct trace_header *hdr = map;
+  hdr->record_size = sizeof(struct trace_record);
+  hdr->capacity = capacity;
+  hdr->pid = getpid();
+  snprintf(hdr->name, sizeof(hdr->name), "%s", name);
+  memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+  trace_ring = hdr;
+}
+
+void trace_write(enum trace_event event, uint64_t arg0, uint64_t arg1) {
+  struct trace_header *hdr = trace_ring;
+  uint64_t i = atomic_fetch_add_explicit((_Atomic uint64_t *)&hdr->head, 1,
+                                         memory_order_relaxed);
+  struct trace_record *r = &hdr->records[i & (hdr->capacity - 1)];
+
+  /* seqlock style: readers see the old or the new sequence number around a
+   * consistent copy, or 0 */
+  atomic_store_explicit((_Atomic uint32_t *)&r->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  r->event = event;
+  r->args[0] = arg0;
+  r->args[1] = arg1;
+  atomic_store_explicit((_Atomic uint32_t *)&r->seq, (uint32_t)(i + 1),
+                        memory_order_release);
+}
+
+uint64_t trace_str(const char *s) {
+  struct trace_header *hdr = trace_ring;
+  uint32_t len = atomic_load_explicit((_Atomic uint32_t *)&hdr->strings_len,
+                                      memory_order_acquire);
+  bool full = len >= sizeof(hdr->strings);
+  if (full)
+    len = sizeof(hdr->strings);
+
+  for (uint32_t off = 0; off < len; off += strlen(hdr->strings + off) + 1) {
+    if (strcmp(hdr->strings + off, s) == 0)
+      return off + 1;
+  }
+  /* no more reservations once full, strings_len would wrap eventually and
+   * new strings overwrite live ones */
+  if (full)
+    return 0;
+
+  uint32_t n = strlen(s) + 1;
+  uint32_t off = atomic_fetch_add_explicit(
+      (_Atomic uint32_t *)&hdr->strings_len, n, memory_order_acq_rel);
+  if (off + n > sizeof(hdr->strings))
+    return 0;
+  memcpy(hdr->strings + off, s, n);
+  return off + 1;
+}
+
+int trace_map_open(const char *path, struct trace_map *m) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct trace_header))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  const struct trace_header *hdr = map;
+  if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->record_size != sizeof(struct trace_record) ||
+      sizeof(*hdr) + (size_t)hdr->capacity * hdr->record_size >
+          (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  m->hdr = hdr;
+  m->size = st.st_size;
+  return 0;
+}
+
+void trace_map_close(struct trace_map *m) {
+  munmap((void *)m->hdr, m->size);
+  m->hdr = NULL;
+}
+
+uint64_t trace_map_head(const struct trace_map *m) {
+  return atomic_load_explicit((_Atomic uint64_t *)&m->hdr->head,
+                              memory_order_acquire);
+}
+
+bool trace_map_get(const struct trace_map *m, uint64_t seq,
+                   struct trace_record *out) {
+  const struct trace_record *r =
+      &m->hdr->records[(seq - 1) & (m->hdr->capacity - 1)];
+  uint32_t want = (uint32_t)seq;
+
+  if (atomic_load_explicit((_Atomic uint32_t *)&r->seq,
+                           memory_order_acquire) != want)
+    return false;
+  memcpy(out, r, sizeof(*out));
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit((_Atomic uint32_t *)&r->seq,
+                              memory_order_relaxed) == want &&
+         out->event < TRACE_N_EVENTS;
+}
+
+const char *trace_map_string(const struct trace_map *m, uint64_t off) {
+  const struct trace_header *hdr = m->hdr;
+  uint32_t len = atomic_load_explicit((_Atomic uint32_t *)&hdr->strings_len,
+                                      memory_order_acquire);
+  if (len > sizeof(hdr->strings))
+    len = sizeof(hdr->strings);
+  /* the last string of a full table may be cut */
+  if (off == 0 || off > len || !memchr(hdr->strings + off - 1, '\0', len - off + 1))
+    return "?";
+  return hdr->strings + off - 1;
+}
@@ -0,0 +1,99 @@
+/*
+ * Binary tracing shared by the tools.
+ *
+ * With TRACE_DIR set, a process writes fixed-size records (timestamp, event
+ * id, two 64-bit args) into a ring in $TRACE_DIR/<name>.<pid>, a file mapped
+ * into memory. Writers only do an atomic increment and a few stores, and
+ * never block or make syscalls; trace-decode prints the rings. Without
+ * TRACE_DIR, a TRACE() is one predictable branch and its arguments are not
+ * evaluated.
+ *
+ * Strings (names, match rules) are stored once in a table in the file
+ * header, records refer to them by offset.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace-events.h"
+
+#define TRACE_MAGIC "TRACE01"
+#define TRACE_DEFAULT_RECORDS 8192
+#define TRACE_STRINGS_SIZE 8192
+
+enum trace_event {
+#define X(id, name, a0, k0, a1, k1) TRACE_##id,
+  TRACE_EVENTS(X)
+#undef X
+  TRACE_N_EVENTS
+};
+
+struct trace_event_info {
+  const char *name;
+  const char *arg_names[2];
+  char arg_kinds[2];
+};
+
+extern const struct trace_event_info trace_events[TRACE_N_EVENTS];
+
+struct trace_record {
+  uint64_t ts; /* CLOCK_MONOTONIC, ns */
+  /* low bits of the 1-based sequence number once complete, 0 while written */
+  uint32_t seq;
+  uint16_t event;
+  uint16_t pad;
+  uint64_t args[2];
+};
+
+struct trace_header {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t capacity; /* records, a power of two */
+  uint64_t head;     /* records ever reserved */
+  int32_t pid;
+  char name[60];
+  uint32_t strings_len;
+  uint32_t pad;
+  char strings[TRACE_STRINGS_SIZE];
+  struct trace_record records[];
+};
+
+/* The ring of this process, NULL when tracing is off */
+extern struct trace_header *trace_ring;
+
+/* Starts tracing if TRACE_DIR is set; TRACE_RECORDS overrides the size */
+void trace_init(const char *name);
+void trace_write(enum trace_event event, uint64_t arg0, uint64_t arg1);
+/* Interns a string for 's' args, 0 if the table is full */
+uint64_t trace_str(const char *s);
+
+#define TRACE(event, arg0, arg1)                                               \
+  do {                                                                         \
+    if (__builtin_expect(trace_ring != NULL, 0))                               \
+      trace_write(TRACE_##event, (uint64_t)(arg0), (uint64_t)(arg1));          \
+  } while (0)
+
+/* Reading side, for trace-decode and benches */
+
+struct trace_map {
+  const struct trace_header *hdr;
+  size_t size;
+};
+
+int trace_map_open(const char *path, struct trace_map *m);
+void trace_map_close(struct trace_map *m);
+/* Records reserved so far, i.e. the sequence number of the newest one */
+uint64_t trace_map_head(const struct trace_map *m);
+/*
+ * Copies the record with the given 1-based sequence number. Fails if it is
+ * still being written or was already overwritten.
+ */
+bool trace_map_get(const struct trace_map *m, uint64_t seq,
+                   struct trace_record *out);
+/* The string of an 's' arg, "?" if unknown */
+const char *trace_map_string(const struct trace_map *m, uint64_t off);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * desktop-eventd - runs micro-locker, pwtool and xorg-on-input-hierarchy-change
+ * as modules of one process
+ *
+ * All modules share one epoll loop (common/evloop.h) that multiplexes the
+ * D-Bus connection, the PipeWire loop fd, the X connections and the timers
+ * and pidfds of the running commands, so a session pays for one process
+ * startup, one copy of the libraries' private data and one set of wakeups.
+ * Every pwtool instance also shares a single PipeWire connection.
+ *
+ * Usage: desktop-eventd <module> [args...] [';' <module> [args...]]...
+ *
+ * Modules take the arguments of their standalone binaries and behave the
+ * same. micro-locker and xorg-on-input-hierarchy-change can be given once;
+ * pwtool any number of times, each with the -o fifo it must be given, as
+ * stdout is shared with the other modules and their commands. The daemon
+ * exits when a module gives up (micro-locker losing the system bus).
+ */
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "evloop.h"
+#include "micro-locker.h"
+#include "pwtool.h"
+#include "trace.h"
+#include "xorg-on-input-hierarchy-change.h"
+
+#define SEPARATOR ";"
+
+struct module {
+  const char *name;
+  int (*start)(struct evloop *loop, int argc, char *argv[]);
+  /*
+   * stdout is shared by all modules and the commands they run, so a module
+   * whose output is its interface has to be given its own with -o
+   */
+  bool needs_output;
+};
+
+static const struct module modules[] = {
+    {"micro-locker", micro_locker_start, false},
+    {"pwtool", pwtool_start, true},
+    {"xorg-on-input-hierarchy-change", xorg_input_start, false},
+};
+
+#define N_MODULES (sizeof(modules) / sizeof(modules[0]))
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s <module> [args...] ['" SEPARATOR
+          "' <module> [args...]]...\n"
+          "Modules:",
+          prog);
+  for (size_t i = 0; i < N_MODULES; i++)
+    fprintf(stderr, " %s", modules[i].name);
+  fprintf(stderr, "\n");
+}
+
+static bool has_output(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0)
+      return true;
+  }
+  return false;
+}
+
+static const struct module *find_module(const char *name) {
+  for (size_t i = 0; i < N_MODULES; i++) {
+    if (strcmp(modules[i].name, name) == 0)
+      return &modules[i];
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  /*
+   * micro-locker reads SIGUSR1 from a signalfd, which only works when no
+   * thread has it unblocked. Modules start threads (libpipewire's), and those
+   * inherit the mask of this one, so it is blocked before any module starts.
+   */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  trace_init("desktop-eventd");
+  struct evloop loop;
+  if (evloop_init(&loop) < 0)
+    return 1;
+
+  /* every module gets its slice of argv, NULL terminated like main's */
+  for (int i = 1; i < argc;) {
+    int end = i;
+    while (end < argc && strcmp(argv[end], SEPARATOR) != 0)
+      end++;
+    argv[end] = NULL;
+
+    const struct module *m = i < end ? find_module(argv[i]) : NULL;
+    if (!m) {
+      fprintf(stderr, "Unknown module '%s'\n", i < end ? argv[i] : "");
+      usage(argv[0]);
+      return 1;
+    }
+
+    if (m->needs_output && !has_output(end - i, &argv[i])) {
+      fprintf(stderr, "%s needs -o <fifo> in %s\n", m->name, argv[0]);
+      return 1;
+    }
+
+    /* getopt state is global, start every module from scratch */
+    optind = 0;
+    uint64_t start = now_us();
+    if (m->start(&loop, end - i, &argv[i]) < 0) {
+      fprintf(stderr, "Failed to start %s\n", m->name);
+      return 1;
+    }
+    TRACE(EVD_MODULE, trace_str(m->name), now_us() - start);
+    i = end + 1;
+  }
+
+  return evloop_run(&loop);
+}
@@ -0,0 +1,596 @@
+/*
+ * micro-locker-bench - benchmark and integration harness for micro-locker
+ *
+ * Starts a private dbus-daemon, owns org.freedesktop.login1 on it (answering
+ * GetSessionByPID), runs micro-locker against that bus and emits scripted
+ * bursts of Lock / PrepareForSleep / Unlock signals. micro-locker's trace
+ * ring (see common/trace.h) is used to measure signal-to-exec latency and to
+ * count missed and duplicated spawns; CPU time per signal is taken from /proc.
+ *
+ * Every cycle is one logical lock transition followed by one logical unlock:
+ *   lock burst:   <burst> signals alternating Lock / PrepareForSleep(true),
+ *                 then PrepareForSleep(false) if the burst suspended
+ *   unlock burst: <burst> Unlock signals
+ * so a cycle must produce exactly one lock spawn, one unlock spawn and one
+ * resume spawn (if the burst contained a suspend).
+ *
+ * With -s only ON_SUSPEND is set: the Lock signals have no command, and a
+ * cycle must produce one lock spawn if the burst suspended and nothing else.
+ *
+ * With -r every lock burst follows the previous unlock burst without a gap,
+ * and both go out in one write, so that micro-locker reads the Lock before
+ * the killed locker has been reaped.
+ *
+ * Usage: micro-locker-bench [-n cycles] [-b burst] [-i interval_us]
+ *                           [-w window_ms] [-g gap_ms] [-s] [-r]
+ *                           <micro-locker>
+ */
+#define _GNU_SOURCE
+
+#include <dbus/dbus.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "trace.h"
+
+#define LOGIND_SERVICE "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+#define LOGIND_SESSION_INTERFACE "org.freedesktop.login1.Session"
+#define SESSION_PATH LOGIND_PATH "/session/bench"
+
+enum phase { PHASE_LOCK, PHASE_UNLOCK };
+
+/* spawn kinds reported by micro-locker's ml.exec records */
+enum spawn_kind { SPAWN_LOCK, SPAWN_RESUME, SPAWN_UNLOCK, N_SPAWNS };
+
+static const char *const spawn_names[] = {
+    [SPAWN_LOCK] = "lock",
+    [SPAWN_RESUME] = "resume",
+    [SPAWN_UNLOCK] = "unlock",
+};
+
+struct cycle {
+  uint64_t lock_emit;   /* first signal of the lock burst */
+  uint64_t unlock_emit; /* first signal of the unlock burst */
+  bool suspended;
+  int spawns[N_SPAWNS];
+  uint64_t first_exec[N_SPAWNS];
+};
+
+struct bench {
+  char dir[64]; /* temporary dir holding the bus config and the trace */
+  DBusConnection *conn;
+  int conn_fd;
+
+  pid_t daemon_pid;
+  pid_t locker_pid;
+  char trace_path[600];
+  struct trace_map trace;
+  uint64_t trace_seq; /* next record to read */
+  bool locker_ready;
+
+  struct cycle *cycles;
+  int n_cycles;
+  bool suspend_only;
+  bool relock;
+  int current;
+  uint64_t signals;
+  uint64_t skips;
+  uint64_t stray_spawns;
+};
+
+/* stops the processes and removes the files started so far */
+static void cleanup(struct bench *b) {
+  if (b->locker_pid > 0) {
+    kill(b->locker_pid, SIGTERM);
+    waitpid(b->locker_pid, NULL, 0);
+    b->locker_pid = 0;
+  }
+  if (b->daemon_pid > 0) {
+    kill(b->daemon_pid, SIGTERM);
+    waitpid(b->daemon_pid, NULL, 0);
+    b->daemon_pid = 0;
+  }
+
+  if (b->trace.hdr)
+    trace_map_close(&b->trace);
+  if (b->trace_path[0])
+    unlink(b->trace_path);
+  if (b->dir[0]) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/bus.conf", b->dir);
+    unlink(path);
+    rmdir(b->dir);
+  }
+}
+
+/* the bench being run, cleaned up by die() */
+static struct bench *current_bench;
+
+static void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  if (current_bench)
+    cleanup(current_bench);
+  exit(1);
+}
+
+/* ── private bus ─────────────────────────────────────────────────── */
+
+static const char bus_config[] =
+    "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration "
+    "1.0//EN\"\n"
+    " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+    "<busconfig>\n"
+    "  <type>session</type>\n"
+    "  <listen>unix:tmpdir=%s</listen>\n"
+    "  <auth>EXTERNAL</auth>\n"
+    "  <policy context=\"default\">\n"
+    "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+    "    <allow eavesdrop=\"true\"/>\n"
+    "    <allow own=\"*\"/>\n"
+    "  </policy>\n"
+    "</busconfig>\n";
+
+/* starts dbus-daemon and returns its address */
+static char *start_bus(struct bench *b, const char *dir) {
+  char config_path[512];
+  snprintf(config_path, sizeof(config_path), "%s/bus.conf", dir);
+  FILE *f = fopen(config_path, "w");
+  if (!f)
+    die("Unable to write the dbus-daemon config");
+  fprintf(f, bus_config, dir);
+  fclose(f);
+
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) < 0)
+    die("pipe failed");
+
+  char config_arg[600];
+  snprintf(config_arg, sizeof(config_arg), "--config-file=%s", config_path);
+  char *argv[] = {"dbus-daemon", config_arg, "--nofork", "--print-address=1",
+                  NULL};
+
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, pipefd[1], 1);
+  if (posix_spawnp(&b->daemon_pid, "dbus-daemon", &fa, NULL, argv, environ))
+    die("Unable to start dbus-daemon");
+  posix_spawn_file_actions_destroy(&fa);
+  close(pipefd[1]);
+
+  /* the address is printed once the bus is ready */
+  FILE *out = fdopen(pipefd[0], "r");
+  char line[512];
+  if (!fgets(line, sizeof(line), out))
+    die("dbus-daemon did not print its address");
+  fclose(out);
+  line[strcspn(line, "\n")] = '\0';
+  return strdup(line);
+}
+
+static void connect_bus(struct bench *b, const char *address) {
+  DBusError err;
+  dbus_error_init(&err);
+
+  b->conn = dbus_connection_open_private(address, &err);
+  if (!b->conn || !dbus_bus_register(b->conn, &err)) {
+    fprintf(stderr, "Unable to connect to %s: %s\n", address, err.message);
+    die("No private bus");
+  }
+  dbus_connection_set_exit_on_disconnect(b->conn, false);
+
+  int res = dbus_bus_request_name(b->conn, LOGIND_SERVICE,
+                                  DBUS_NAME_FLAG_DO_NOT_QUEUE, &err);
+  if (res != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die("Unable to own " LOGIND_SERVICE);
+
+  if (!dbus_connection_get_unix_fd(b->conn, &b->conn_fd))
+    die("Unable to get the DBus connection fd");
+}
+
+/* the fake logind only needs to know about one session */
+static void handle_method_call(struct bench *b, DBusMessage *msg) {
+  DBusMessage *reply;
+  if (dbus_message_is_method_call(msg, LOGIND_MANAGER_INTERFACE,
+                                  "GetSessionByPID")) {
+    const char *path = SESSION_PATH;
+    reply = dbus_message_new_method_return(msg);
+    dbus_message_append_args(reply, DBUS_TYPE_OBJECT_PATH, &path,
+                             DBUS_TYPE_INVALID);
+  } else {
+    reply = dbus_message_new_error(msg,
+                                   "org.freedesktop.DBus.Error.UnknownMethod",
+                                   "Not implemented by micro-locker-bench");
+  }
+  dbus_connection_send(b->conn, reply, NULL);
+  dbus_message_unref(reply);
+  dbus_connection_flush(b->conn);
+}
+
+/* returns the emit timestamp */
+static uint64_t emit(struct bench *b, const char *path, const char *interface,
+                     const char *member, int value) {
+  DBusMessage *msg = dbus_message_new_signal(path, interface, member);
+  if (value >= 0) {
+    dbus_bool_t v = value;
+    dbus_message_append_args(msg, DBUS_TYPE_BOOLEAN, &v, DBUS_TYPE_INVALID);
+  }
+
+  uint64_t t = now_us();
+  dbus_connection_send(b->conn, msg, NULL);
+  /* -r: flushed by the next run_until() */
+  if (!b->relock)
+    dbus_connection_flush(b->conn);
+  dbus_message_unref(msg);
+  b->signals++;
+  return t;
+}
+
+/* ── micro-locker ────────────────────────────────────────────────── */
+
+static void start_locker(struct bench *b, const char *locker,
+                         const char *address, const char *home,
+                         unsigned window_ms) {
+  char bus_env[600], home_env[600], window_env[64], trace_env[600];
+  snprintf(bus_env, sizeof(bus_env), "DBUS_SYSTEM_BUS_ADDRESS=%s", address);
+  snprintf(home_env, sizeof(home_env), "HOME=%s", home);
+  snprintf(window_env, sizeof(window_env), "COALESCE_MS=%u", window_ms);
+  snprintf(trace_env, sizeof(trace_env), "TRACE_DIR=%s", home);
+  char *envp[] = {
+      bus_env,
+      home_env,
+      window_env,
+      trace_env,
+      /* enough for a few thousand cycles between two reads */
+      "TRACE_RECORDS=65536",
+      "PATH=/usr/local/bin:/usr/bin:/bin",
+      /* a foreground locker stand-in, killed on unlock */
+      "ON_SUSPEND=exec sleep 600",
+      "ON_LOCK=exec sleep 600",
+      "ON_RESUME=:",
+      "ON_UNLOCK=:",
+      NULL,
+  };
+  /* -s: cut the list right after ON_SUSPEND */
+  if (b->suspend_only)
+    envp[7] = NULL;
+  char *argv[] = {(char *)locker, NULL};
+
+  if (posix_spawn(&b->locker_pid, locker, NULL, NULL, argv, envp))
+    die("Unable to start micro-locker");
+
+  snprintf(b->trace_path, sizeof(b->trace_path), "%s/micro-locker.%d", home,
+           b->locker_pid);
+  b->trace_seq = 1;
+}
+
+static int spawn_kind(const char *event) {
+  if (strcmp(event, "lock") == 0 || strcmp(event, "suspend") == 0)
+    return SPAWN_LOCK;
+  if (strcmp(event, "resume") == 0)
+    return SPAWN_RESUME;
+  if (strcmp(event, "unlock") == 0)
+    return SPAWN_UNLOCK;
+  return -1;
+}
+
+/* attributes a spawn to the last cycle whose burst of that kind had started;
+ * with -r an unlock spawn may well happen after the next lock burst */
+static void record_spawn(struct bench *b, int kind, uint64_t t) {
+  enum phase expected = kind == SPAWN_UNLOCK ? PHASE_UNLOCK : PHASE_LOCK;
+  struct cycle *c = NULL;
+  for (int i = b->current; i >= 0; i--) {
+    uint64_t emit = expected == PHASE_UNLOCK ? b->cycles[i].unlock_emit
+                                             : b->cycles[i].lock_emit;
+    if (emit && emit <= t) {
+      c = &b->cycles[i];
+      break;
+    }
+  }
+
+  if (!c || (expected == PHASE_LOCK && c->unlock_emit &&
+             c->unlock_emit <= t)) {
+    b->stray_spawns++;
+    return;
+  }
+
+  if (c->spawns[kind]++ == 0)
+    c->first_exec[kind] = t;
+}
+
+static void handle_record(struct bench *b, const struct trace_record *r) {
+  uint64_t t = r->ts / 1000;
+
+  switch (r->event) {
+  case TRACE_ML_LISTEN:
+    b->locker_ready = true;
+    break;
+  case TRACE_ML_EXEC: {
+    int kind = spawn_kind(trace_map_string(&b->trace, r->args[0]));
+    if (kind >= 0)
+      record_spawn(b, kind, t);
+    break;
+  }
+  case TRACE_ML_SKIP:
+    b->skips++;
+    break;
+  }
+}
+
+static void read_locker_trace(struct bench *b) {
+  int status;
+  if (waitpid(b->locker_pid, &status, WNOHANG) == b->locker_pid) {
+    b->locker_pid = 0;
+    die("micro-locker exited");
+  }
+
+  /* the file appears once micro-locker has started */
+  if (!b->trace.hdr && trace_map_open(b->trace_path, &b->trace) < 0)
+    return;
+
+  uint64_t head = trace_map_head(&b->trace);
+  if (head >= b->trace_seq + b->trace.hdr->capacity)
+    die("micro-locker's trace ring overran, raise TRACE_RECORDS");
+
+  struct trace_record r;
+  /* stop at a record still being written, it is read on the next pass */
+  while (b->trace_seq <= head && trace_map_get(&b->trace, b->trace_seq, &r)) {
+    handle_record(b, &r);
+    b->trace_seq++;
+  }
+}
+
+/* services the bus and reads micro-locker's trace until the deadline */
+static void run_until(struct bench *b, uint64_t deadline) {
+  dbus_connection_flush(b->conn);
+  while (true) {
+    DBusMessage *msg;
+    while ((msg = dbus_connection_pop_message(b->conn)) != NULL) {
+      if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        handle_method_call(b, msg);
+      dbus_message_unref(msg);
+    }
+
+    uint64_t now = now_us();
+    if (now >= deadline)
+      return;
+
+    /* the trace has no fd to wait on, it is polled every millisecond */
+    struct pollfd fd = {.fd = b->conn_fd, .events = POLLIN};
+    if (poll(&fd, 1, 1) < 0 && errno != EINTR)
+      die("poll failed");
+
+    if (fd.revents && !dbus_connection_read_write(b->conn, 0))
+      die("Lost the private bus");
+    read_locker_trace(b);
+  }
+}
+
+/* CPU time consumed by a process so far, in microseconds */
+static uint64_t cpu_us(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/schedstat", pid);
+  FILE *f = fopen(path, "r");
+  if (f) {
+    unsigned long long ns;
+    int n = fscanf(f, "%llu", &ns);
+    fclose(f);
+    if (n == 1)
+      return ns / 1000;
+  }
+
+  /* no schedstat: fall back to utime + stime, at clock tick resolution */
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  f = fopen(path, "r");
+  if (!f)
+    return 0;
+  unsigned long long utime = 0, stime = 0;
+  int n = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu "
+                 "%llu", &utime, &stime);
+  fclose(f);
+  return n == 2 ? (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK) : 0;
+}
+
+/* ── report ──────────────────────────────────────────────────────── */
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void report_latency(const char *name, uint64_t *samples, int n) {
+  if (n == 0) {
+    printf("latency %-7s no samples\n", name);
+    return;
+  }
+  qsort(samples, n, sizeof(*samples), cmp_u64);
+  uint64_t sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += samples[i];
+  printf("latency %-7s n=%d min=%" PRIu64 "us avg=%" PRIu64 "us p50=%" PRIu64
+         "us p99=%" PRIu64 "us max=%" PRIu64 "us\n",
+         name, n, samples[0], sum / n, samples[n / 2],
+         samples[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1], samples[n - 1]);
+}
+
+/* returns whether every cycle spawned exactly what it should have */
+static bool report(struct bench *b, uint64_t cpu, uint64_t elapsed) {
+  int missed = 0, duplicated = 0;
+  int spawns[N_SPAWNS] = {0};
+  uint64_t *lat[N_SPAWNS];
+  int n_lat[N_SPAWNS] = {0};
+  for (int k = 0; k < N_SPAWNS; k++)
+    lat[k] = calloc(b->n_cycles, sizeof(uint64_t));
+
+  for (int i = 0; i < b->n_cycles; i++) {
+    struct cycle *c = &b->cycles[i];
+    for (int k = 0; k < N_SPAWNS; k++) {
+      int expected = k == SPAWN_RESUME ? c->suspended : 1;
+      if (b->suspend_only)
+        expected = k == SPAWN_LOCK ? c->suspended : 0;
+      spawns[k] += c->spawns[k];
+      if (c->spawns[k] < expected)
+        missed += expected - c->spawns[k];
+      else if (c->spawns[k] > expected)
+        duplicated += c->spawns[k] - expected;
+
+      if (c->spawns[k] == 0)
+        continue;
+      uint64_t emit = k == SPAWN_UNLOCK ? c->unlock_emit : c->lock_emit;
+      lat[k][n_lat[k]++] = c->first_exec[k] - emit;
+    }
+  }
+
+  printf("cycles=%d signals=%" PRIu64 " elapsed=%" PRIu64 "ms\n", b->n_cycles,
+         b->signals, elapsed / 1000);
+  printf("spawns lock=%d resume=%d unlock=%d skipped=%" PRIu64
+         " stray=%" PRIu64 "\n",
+         spawns[SPAWN_LOCK], spawns[SPAWN_RESUME], spawns[SPAWN_UNLOCK],
+         b->skips, b->stray_spawns);
+  printf("missed=%d duplicated=%d\n", missed, duplicated);
+  for (int k = 0; k < N_SPAWNS; k++) {
+    report_latency(spawn_names[k], lat[k], n_lat[k]);
+    free(lat[k]);
+  }
+  printf("cpu total=%" PRIu64 "us per_signal=%.1fus\n", cpu,
+         b->signals ? (double)cpu / b->signals : 0.0);
+  return missed == 0 && duplicated == 0 && b->stray_spawns == 0;
+}
+
+/* ── main ────────────────────────────────────────────────────────── */
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-n cycles] [-b burst] [-i interval_us] [-w window_ms] "
+          "[-g gap_ms] [-s] [-r] <micro-locker>\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned cycles = 100, burst = 3, interval_us = 0, window_ms = 100;
+  int gap_ms = -1;
+  bool suspend_only = false, relock = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:i:w:g:sr")) != -1) {
+    switch (opt) {
+    case 'n':
+      cycles = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      burst = strtoul(optarg, NULL, 10);
+      break;
+    case 'i':
+      interval_us = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      window_ms = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      gap_ms = strtol(optarg, NULL, 10);
+      break;
+    case 's':
+      suspend_only = true;
+      break;
+    case 'r':
+      relock = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc || cycles == 0 || burst == 0)
+    usage(argv[0]);
+  /* phases must be further apart than the coalescing window */
+  if (gap_ms < 0)
+    gap_ms = window_ms + 50;
+
+  struct bench b = {
+      .n_cycles = cycles, .suspend_only = suspend_only, .relock = relock};
+  b.cycles = calloc(cycles, sizeof(*b.cycles));
+  current_bench = &b;
+
+  snprintf(b.dir, sizeof(b.dir), "/tmp/micro-locker-bench.XXXXXX");
+  if (!mkdtemp(b.dir)) {
+    b.dir[0] = '\0';
+    die("Unable to create a temporary directory");
+  }
+
+  char *address = start_bus(&b, b.dir);
+  connect_bus(&b, address);
+  start_locker(&b, argv[optind], address, b.dir, window_ms);
+
+  /* wait for micro-locker to subscribe */
+  uint64_t deadline = now_us() + 5000000;
+  while (!b.locker_ready && now_us() < deadline)
+    run_until(&b, now_us() + 10000);
+  if (!b.locker_ready)
+    die("micro-locker did not start listening");
+  /* the match rules are processed by the bus asynchronously */
+  run_until(&b, now_us() + 100000);
+
+  uint64_t cpu_start = cpu_us(b.locker_pid);
+  uint64_t start = now_us();
+
+  for (unsigned i = 0; i < cycles; i++) {
+    struct cycle *c = &b.cycles[i];
+    b.current = i;
+
+    for (unsigned j = 0; j < burst; j++) {
+      uint64_t t;
+      if (j % 2 == 0) {
+        t = emit(&b, SESSION_PATH, LOGIND_SESSION_INTERFACE, "Lock", -1);
+      } else {
+        t = emit(&b, LOGIND_PATH, LOGIND_MANAGER_INTERFACE, "PrepareForSleep",
+                 1);
+        c->suspended = true;
+      }
+      if (j == 0)
+        c->lock_emit = t;
+      if (interval_us)
+        run_until(&b, now_us() + interval_us);
+    }
+    if (c->suspended)
+      emit(&b, LOGIND_PATH, LOGIND_MANAGER_INTERFACE, "PrepareForSleep", 0);
+    run_until(&b, now_us() + gap_ms * 1000);
+
+    for (unsigned j = 0; j < burst; j++) {
+      uint64_t t =
+          emit(&b, SESSION_PATH, LOGIND_SESSION_INTERFACE, "Unlock", -1);
+      if (j == 0)
+        c->unlock_emit = t;
+      if (interval_us)
+        run_until(&b, now_us() + interval_us);
+    }
+    /* -r: the next Lock goes out right behind the Unlock */
+    if (!b.relock || i + 1 == cycles)
+      run_until(&b, now_us() + gap_ms * 1000);
+  }
+
+  uint64_t elapsed = now_us() - start;
+  uint64_t cpu = cpu_us(b.locker_pid) - cpu_start;
+  bool ok = report(&b, cpu, elapsed);
+
+  cleanup(&b);
+  dbus_connection_close(b.conn);
+  dbus_connection_unref(b.conn);
+  free(address);
+  free(b.cycles);
+  /* make bench fails on missed, duplicated or stray spawns */
+  return ok ? 0 : 1;
+}
@@ -0,0 +1 @@
+../common/clock.h
\ No newline at end of file
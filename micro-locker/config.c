@@ -0,0 +1 @@
+../common/config.c
\ No newline at end of file
@@ -0,0 +1 @@
+../common/config.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/evloop.c
\ No newline at end of file
@@ -0,0 +1 @@
+../common/evloop.h
\ No newline at end of file
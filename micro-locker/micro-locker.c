@@ -0,0 +1,935 @@
+#define _GNU_SOURCE
+
+#include <dbus/dbus.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/pidfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "config.h"
+#include "micro-locker.h"
+#include "trace.h"
+
+#define LOGIND_SERVICE "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+#define LOGIND_SESSION_INTERFACE "org.freedesktop.login1.Session"
+#define PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+#define UPOWER_SERVICE "org.freedesktop.UPower"
+#define UPOWER_PATH "/org/freedesktop/UPower"
+
+/* unique name currently owning a well-known name, NULL if it has no owner */
+static char *get_name_owner(DBusConnection *conn, const char *name) {
+  DBusMessage *message =
+      dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                   DBUS_INTERFACE_DBUS, "GetNameOwner");
+  if (message == NULL ||
+      !dbus_message_append_args(message, DBUS_TYPE_STRING, &name,
+                                DBUS_TYPE_INVALID)) {
+    fprintf(stderr, "Couldn't allocate dbus message\n");
+    exit(1);
+  }
+
+  DBusError error;
+  dbus_error_init(&error);
+  DBusMessage *reply =
+      dbus_connection_send_with_reply_and_block(conn, message, -1, &error);
+  dbus_message_unref(message);
+
+  if (dbus_error_is_set(&error)) {
+    if (!dbus_error_has_name(&error, DBUS_ERROR_NAME_HAS_NO_OWNER))
+      fprintf(stderr, "Dbus call error. %s: %s\n", error.name, error.message);
+    dbus_error_free(&error);
+    return NULL;
+  }
+
+  const char *owner;
+  char *result = NULL;
+  if (dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &owner,
+                            DBUS_TYPE_INVALID))
+    result = strdup(owner);
+  dbus_message_unref(reply);
+  return result;
+}
+
+static char *get_session_id(DBusConnection *conn) {
+  dbus_uint32_t pid = getpid();
+
+  DBusMessage *message = dbus_message_new_method_call(
+      LOGIND_SERVICE, LOGIND_PATH, LOGIND_MANAGER_INTERFACE, "GetSessionByPID");
+
+  if (message == NULL) {
+    fprintf(stderr, "Couldn't allocate dbus message\n");
+    exit(1);
+  }
+
+  if (!dbus_message_append_args(message, DBUS_TYPE_UINT32, &pid,
+                                DBUS_TYPE_INVALID)) {
+    fprintf(stderr, "Couldn't append arguments to a dbus message\n");
+    dbus_message_unref(message);
+    exit(1);
+  }
+
+  DBusError error;
+  dbus_error_init(&error);
+  DBusMessage *reply =
+      dbus_connection_send_with_reply_and_block(conn, message, -1, &error);
+
+  dbus_message_unref(message);
+
+  if (dbus_error_is_set(&error)) {
+    fprintf(stderr, "Dbus call error. %s: %s\n", error.name, error.message);
+    dbus_error_free(&error);
+    exit(1);
+  }
+
+  char *sessionId;
+  if (dbus_message_get_args(reply, &error, DBUS_TYPE_OBJECT_PATH, &sessionId,
+                            DBUS_TYPE_INVALID)) {
+    sessionId = strdup(sessionId);
+  } else {
+    fprintf(stderr, "No session id\n");
+    exit(1);
+  }
+
+  dbus_message_unref(reply);
+
+  if (dbus_error_is_set(&error)) {
+    fprintf(stderr, "Dbus args get error. %s: %s\n", error.name, error.message);
+    dbus_error_free(&error);
+    exit(1);
+  }
+
+  return sessionId;
+}
+
+/*
+ * Events micro-locker can react to. Every event has a config file key and an
+ * env variable (ON_<KEY>) holding the command to run, and is selected by a
+ * logind signal or a PropertiesChanged notification carrying a boolean.
+ *
+ * logind doesn't announce changes of Manager.LidClosed (EmitsChangedSignal is
+ * false), so the lid events come from UPower's LidIsClosed instead.
+ */
+
+enum event_kind { KIND_LOCK, KIND_UNLOCK, KIND_SUSPEND, KIND_RESUME, KIND_OTHER };
+
+enum event_path { PATH_MANAGER, PATH_SESSION, PATH_UPOWER };
+
+struct event {
+  const char *name;
+  const char *env;
+  enum event_kind kind;
+  enum event_path path;
+  const char *interface;
+  const char *member;   /* signal member, or a property name */
+  bool property;        /* member is a property announced by PropertiesChanged */
+  int value;            /* boolean argument selecting this event, -1 for any */
+};
+
+static const struct event events[] = {
+    {"lock", "ON_LOCK", KIND_LOCK, PATH_SESSION, LOGIND_SESSION_INTERFACE,
+     "Lock", false, -1},
+    {"unlock", "ON_UNLOCK", KIND_UNLOCK, PATH_SESSION,
+     LOGIND_SESSION_INTERFACE, "Unlock", false, -1},
+    {"suspend", "ON_SUSPEND", KIND_SUSPEND, PATH_MANAGER,
+     LOGIND_MANAGER_INTERFACE, "PrepareForSleep", false, 1},
+    {"resume", "ON_RESUME", KIND_RESUME, PATH_MANAGER,
+     LOGIND_MANAGER_INTERFACE, "PrepareForSleep", false, 0},
+    {"shutdown", "ON_SHUTDOWN", KIND_OTHER, PATH_MANAGER,
+     LOGIND_MANAGER_INTERFACE, "PrepareForShutdown", false, 1},
+    {"shutdown-abort", "ON_SHUTDOWN_ABORT", KIND_OTHER, PATH_MANAGER,
+     LOGIND_MANAGER_INTERFACE, "PrepareForShutdown", false, 0},
+    {"idle", "ON_IDLE", KIND_OTHER, PATH_SESSION, LOGIND_SESSION_INTERFACE,
+     "IdleHint", true, 1},
+    {"idle-end", "ON_IDLE_END", KIND_OTHER, PATH_SESSION,
+     LOGIND_SESSION_INTERFACE, "IdleHint", true, 0},
+    {"active", "ON_ACTIVE", KIND_OTHER, PATH_SESSION, LOGIND_SESSION_INTERFACE,
+     "Active", true, 1},
+    {"inactive", "ON_INACTIVE", KIND_OTHER, PATH_SESSION,
+     LOGIND_SESSION_INTERFACE, "Active", true, 0},
+    {"lid-close", "ON_LID_CLOSE", KIND_OTHER, PATH_UPOWER, UPOWER_SERVICE,
+     "LidIsClosed", true, 1},
+    {"lid-open", "ON_LID_OPEN", KIND_OTHER, PATH_UPOWER, UPOWER_SERVICE,
+     "LidIsClosed", true, 0},
+};
+
+#define N_EVENTS (sizeof(events) / sizeof(events[0]))
+
+/*
+ * Config format (~/.config/micro-locker/config):
+ *   # event = "command"
+ *   lock = "i3lock -n"
+ *   lid-close = "notify-send \"lid closed\""
+ *
+ * Supports \" escape inside quoted strings. ON_<EVENT> env variables take
+ * precedence over the config file.
+ */
+
+static int find_event(const char *name, size_t len) {
+  for (size_t i = 0; i < N_EVENTS; i++) {
+    if (strlen(events[i].name) == len && strncmp(events[i].name, name, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void load_config(char *commands[N_EVENTS]) {
+  struct config_file cf;
+  const char *p;
+  if (config_open(&cf, "micro-locker")) {
+    while ((p = config_next(&cf))) {
+      /* event = "command" */
+      const char *key = p;
+      while (*p && *p != ' ' && *p != '\t' && *p != '=')
+        p++;
+      int ev = find_event(key, p - key);
+
+      config_skip_blanks(&p);
+      if (ev < 0 || *p != '=') {
+        fprintf(stderr, "%s:%d: expected <event> = \"<command>\"\n", cf.path,
+                cf.lineno);
+        continue;
+      }
+      p++;
+      config_skip_blanks(&p);
+
+      char *value = config_quoted(&p);
+      if (!value) {
+        fprintf(stderr, "%s:%d: expected a quoted command\n", cf.path,
+                cf.lineno);
+        continue;
+      }
+      free(commands[ev]);
+      commands[ev] = value;
+    }
+  }
+
+  for (size_t i = 0; i < N_EVENTS; i++) {
+    const char *value = getenv(events[i].env);
+    if (value != NULL) {
+      free(commands[i]);
+      commands[i] = strdup(value);
+    }
+    if (commands[i] != NULL && commands[i][0] == '\0') {
+      free(commands[i]);
+      commands[i] = NULL;
+    }
+  }
+}
+
+/*
+ * Dispatch table, keyed by the (interface, member, path) of the incoming
+ * signal. Built once at startup from the configured events; the same keys
+ * are used to generate bus match rules, so the bus only wakes us up for
+ * signals that have a handler.
+ */
+
+#define DISPATCH_SIZE 32 /* power of two, > N_EVENTS */
+
+struct dispatch {
+  const char *sender;
+  const char *interface;
+  const char *member;
+  const char *path;
+  uint32_t hash;
+  /* PropertiesChanged: interface the properties belong to (arg0) */
+  const char *properties_interface;
+  uint8_t events[N_EVENTS];
+  uint8_t n_events;
+};
+
+static uint32_t fnv1a(uint32_t hash, const char *s) {
+  for (; *s; s++) {
+    hash ^= (unsigned char)*s;
+    hash *= 16777619u;
+  }
+  /* separate the fields */
+  hash ^= 0xff;
+  hash *= 16777619u;
+  return hash;
+}
+
+static uint32_t dispatch_hash(const char *interface, const char *member,
+                              const char *path) {
+  return fnv1a(fnv1a(fnv1a(2166136261u, interface), member), path);
+}
+
+/* returns the slot index for the key, either occupied by it or empty */
+static int dispatch_slot(const struct dispatch table[DISPATCH_SIZE],
+                         const char *interface, const char *member,
+                         const char *path) {
+  uint32_t hash = dispatch_hash(interface, member, path);
+  for (uint32_t i = 0; i < DISPATCH_SIZE; i++) {
+    int slot = (hash + i) & (DISPATCH_SIZE - 1);
+    const struct dispatch *d = &table[slot];
+    if (d->interface == NULL)
+      return slot;
+    if (d->hash == hash && strcmp(d->interface, interface) == 0 &&
+        strcmp(d->member, member) == 0 && strcmp(d->path, path) == 0)
+      return slot;
+  }
+  return -1; /* can't happen, the table is larger than N_EVENTS */
+}
+
+static void dispatch_add(struct dispatch table[DISPATCH_SIZE], size_t ev,
+                         const char *session_path) {
+  const struct event *e = &events[ev];
+  const char *path = e->path == PATH_SESSION ? session_path
+                     : e->path == PATH_UPOWER ? UPOWER_PATH
+                                              : LOGIND_PATH;
+  const char *interface = e->property ? PROPERTIES_INTERFACE : e->interface;
+  const char *member = e->property ? "PropertiesChanged" : e->member;
+
+  struct dispatch *d = &table[dispatch_slot(table, interface, member, path)];
+  if (d->interface == NULL) {
+    d->sender = e->path == PATH_UPOWER ? UPOWER_SERVICE : LOGIND_SERVICE;
+    d->interface = interface;
+    d->member = member;
+    d->path = path;
+    d->hash = dispatch_hash(interface, member, path);
+    d->properties_interface = e->property ? e->interface : NULL;
+  }
+  d->events[d->n_events++] = ev;
+}
+
+static const struct dispatch *
+dispatch_lookup(const struct dispatch table[DISPATCH_SIZE], DBusMessage *msg) {
+  const char *interface = dbus_message_get_interface(msg);
+  const char *member = dbus_message_get_member(msg);
+  const char *path = dbus_message_get_path(msg);
+  if (!interface || !member || !path)
+    return NULL;
+
+  int slot = dispatch_slot(table, interface, member, path);
+  return slot >= 0 && table[slot].interface ? &table[slot] : NULL;
+}
+
+/*
+ * The system bus lets any client send a signal to us directly, so signals are
+ * only accepted from the current owner of the name they are expected from.
+ * The owners are resolved once and then followed through NameOwnerChanged.
+ */
+
+#define MAX_SENDERS 2 /* logind and UPower */
+
+struct sender {
+  const char *name;
+  char *owner; /* unique name, NULL while nobody owns the name */
+};
+
+static struct sender *find_sender(struct sender senders[MAX_SENDERS],
+                                  const char *name) {
+  for (int i = 0; i < MAX_SENDERS && senders[i].name; i++) {
+    if (strcmp(senders[i].name, name) == 0)
+      return &senders[i];
+  }
+  return NULL;
+}
+
+static void watch_senders(DBusConnection *conn,
+                          const struct dispatch table[DISPATCH_SIZE],
+                          struct sender senders[MAX_SENDERS]) {
+  int n = 0;
+  for (int i = 0; i < DISPATCH_SIZE; i++) {
+    const char *name = table[i].sender;
+    if (name == NULL || find_sender(senders, name))
+      continue;
+    senders[n++].name = name;
+
+    /* subscribe before asking, so that no change can be missed */
+    char *rule;
+    asprintf(&rule,
+             "type='signal',sender='%s',interface='%s'"
+             ",member='NameOwnerChanged',arg0='%s'",
+             DBUS_SERVICE_DBUS, DBUS_INTERFACE_DBUS, name);
+    TRACE(ML_MATCH, trace_str(rule), 0);
+    dbus_bus_add_match(conn, rule, NULL);
+    free(rule);
+  }
+
+  for (int i = 0; i < n; i++)
+    senders[i].owner = get_name_owner(conn, senders[i].name);
+}
+
+/* NameOwnerChanged(s name, s old_owner, s new_owner) from the bus itself */
+static void update_sender(struct sender senders[MAX_SENDERS],
+                          DBusMessage *msg) {
+  const char *sender = dbus_message_get_sender(msg);
+  const char *name, *old_owner, *new_owner;
+  if (!sender || strcmp(sender, DBUS_SERVICE_DBUS) != 0 ||
+      !dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner, DBUS_TYPE_STRING,
+                             &new_owner, DBUS_TYPE_INVALID))
+    return;
+
+  struct sender *s = find_sender(senders, name);
+  if (s == NULL)
+    return;
+  free(s->owner);
+  s->owner = new_owner[0] ? strdup(new_owner) : NULL;
+}
+
+static bool from_owner(struct sender senders[MAX_SENDERS],
+                       const struct dispatch *d, DBusMessage *msg) {
+  const struct sender *s = find_sender(senders, d->sender);
+  const char *sender = dbus_message_get_sender(msg);
+  return s && s->owner && sender && strcmp(s->owner, sender) == 0;
+}
+
+static void dispatch_add_matches(DBusConnection *conn,
+                                 const struct dispatch table[DISPATCH_SIZE]) {
+  for (int i = 0; i < DISPATCH_SIZE; i++) {
+    const struct dispatch *d = &table[i];
+    if (d->interface == NULL)
+      continue;
+
+    char *rule;
+    if (d->properties_interface) {
+      asprintf(&rule,
+               "type='signal',sender='%s'"
+               ",interface='%s',member='%s',path='%s',arg0='%s'",
+               d->sender, d->interface, d->member, d->path,
+               d->properties_interface);
+    } else {
+      asprintf(&rule,
+               "type='signal',sender='%s'"
+               ",interface='%s',member='%s',path='%s'",
+               d->sender, d->interface, d->member, d->path);
+    }
+    TRACE(ML_MATCH, trace_str(rule), 0);
+    dbus_bus_add_match(conn, rule, NULL);
+    free(rule);
+  }
+}
+
+/*
+ * logind tends to emit several signals for one logical transition (e.g. a lid
+ * close during an idle lock gives Lock + PrepareForSleep back to back). The
+ * state machine below makes every logical transition cost exactly one spawn:
+ * a locker is not started while the previous one is still alive or was
+ * started less than COALESCE_MS ago. An unlock kills the live locker and
+ * closes that window, so a Lock right after it starts a new locker at once.
+ * Other events are only deduplicated by the same window.
+ *
+ * Lockers are best run in the foreground (e.g. `i3lock -n`) so that the
+ * child can be tracked; forking lockers are only deduplicated by the window.
+ */
+
+#define DEFAULT_COALESCE_MS 500
+#define MAX_CHILDREN 8
+
+enum lock_state { STATE_UNLOCKED, STATE_LOCKED, STATE_SUSPENDING };
+
+/*
+ * Latency histograms, one per event and stage. Buckets are powers of two in
+ * microseconds: bucket i counts samples in [2^(i-1), 2^i). Dumped to stderr
+ * on SIGUSR1.
+ */
+
+#define HIST_BUCKETS 32
+
+enum stage {
+  STAGE_DISPATCH, /* bus read -> handler */
+  STAGE_SPAWN,    /* handler -> spawn start (state machine) */
+  STAGE_EXEC,     /* spawn start -> command exec'd */
+  STAGE_TOTAL,    /* bus read -> command exec'd */
+  STAGE_RUN,      /* command exec'd -> exit */
+  N_STAGES,
+};
+
+static const char *const stage_names[] = {
+    [STAGE_DISPATCH] = "dispatch", [STAGE_SPAWN] = "spawn",
+    [STAGE_EXEC] = "exec",         [STAGE_TOTAL] = "total",
+    [STAGE_RUN] = "run",
+};
+
+struct histogram {
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint32_t buckets[HIST_BUCKETS];
+};
+
+static void hist_add(struct histogram *h, uint64_t us) {
+  int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= HIST_BUCKETS)
+    bucket = HIST_BUCKETS - 1;
+  h->buckets[bucket]++;
+  h->count++;
+  h->sum_us += us;
+  if (us > h->max_us)
+    h->max_us = us;
+}
+
+/* upper bound of the bucket holding the given percentile */
+static uint64_t hist_percentile(const struct histogram *h, unsigned pct) {
+  uint64_t rank = (h->count * pct + 99) / 100, seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = i ? 1ull << i : 0;
+      return bound < h->max_us ? bound : h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+/* timestamps of one handled event, in microseconds */
+struct timing {
+  uint64_t recv;
+  uint64_t dispatch;
+  uint64_t spawn;
+  uint64_t exec;
+};
+
+struct locker;
+
+struct child {
+  pid_t pid; /* 0 when the slot is free */
+  int pidfd;
+  size_t event;
+  bool killed; /* a locker sent SIGTERM on unlock */
+  struct timing timing;
+  struct locker *owner;
+  struct evloop_source source;
+};
+
+struct locker {
+  char *commands[N_EVENTS];
+
+  enum lock_state state;
+  uint64_t coalesce_ms;
+
+  /* last time a locker was spawned / an unlock was handled */
+  uint64_t last_lock_ms;
+  uint64_t last_unlock_ms;
+  /* last time any other event was handled */
+  uint64_t last_ms[N_EVENTS];
+
+  /* running commands; the locker (if any) is one of them */
+  struct child children[MAX_CHILDREN];
+  struct child *locker;
+
+  struct histogram latency[N_EVENTS][N_STAGES];
+
+  struct evloop *loop;
+  DBusConnection *conn;
+  struct dispatch table[DISPATCH_SIZE];
+  struct sender senders[MAX_SENDERS];
+  /* time the pending messages were read from the bus */
+  uint64_t recv;
+  int sig_fd;
+  struct evloop_source dbus_source;
+  struct evloop_source sig_source;
+};
+
+static void dump_latency(const struct locker *l) {
+  for (size_t ev = 0; ev < N_EVENTS; ev++) {
+    for (int st = 0; st < N_STAGES; st++) {
+      const struct histogram *h = &l->latency[ev][st];
+      if (h->count == 0)
+        continue;
+      fprintf(stderr,
+              "latency event=%s stage=%s count=%" PRIu64 " avg_us=%" PRIu64
+              " p50_us=%" PRIu64 " p90_us=%" PRIu64 " p99_us=%" PRIu64
+              " max_us=%" PRIu64 " buckets=",
+              events[ev].name, stage_names[st], h->count, h->sum_us / h->count,
+              hist_percentile(h, 50), hist_percentile(h, 90),
+              hist_percentile(h, 99), h->max_us);
+
+      /* only up to the last non-empty bucket */
+      int last = HIST_BUCKETS - 1;
+      while (last > 0 && h->buckets[last] == 0)
+        last--;
+      for (int i = 0; i <= last; i++)
+        fprintf(stderr, "%s%" PRIu32, i ? "," : "", h->buckets[i]);
+      fputc('\n', stderr);
+    }
+  }
+}
+
+static void reap_child(void *data);
+
+static struct child *spawn_command(struct locker *l, size_t ev,
+                                   struct timing t) {
+  const char *cmd = l->commands[ev];
+  if (cmd == NULL)
+    return NULL;
+
+  struct child *c = NULL;
+  for (int i = 0; i < MAX_CHILDREN; i++) {
+    if (l->children[i].pid == 0) {
+      c = &l->children[i];
+      break;
+    }
+  }
+  if (c == NULL) {
+    fprintf(stderr, "Too many running commands, not running '%s'\n", cmd);
+    return NULL;
+  }
+
+  /*
+   * own process group, so that killing a locker also kills its children, and
+   * without the signals blocked for our signalfd
+   */
+  sigset_t empty;
+  sigemptyset(&empty);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr,
+                           POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setsigmask(&attr, &empty);
+
+  char *argv[] = {"sh", "-c", (char *)cmd, NULL};
+  pid_t pid;
+  t.spawn = now_us();
+  /* glibc's posix_spawn only returns once the child has exec'd */
+  int res = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+  t.exec = now_us();
+  posix_spawnattr_destroy(&attr);
+  if (res != 0) {
+    fprintf(stderr, "Unable to run '%s': %s\n", cmd, strerror(res));
+    return NULL;
+  }
+
+  int pidfd = pidfd_open(pid, 0);
+  if (pidfd < 0) {
+    /* can't supervise it, wait for it like system() used to */
+    perror("pidfd_open");
+    waitpid(pid, NULL, 0);
+    return NULL;
+  }
+
+  struct histogram *h = l->latency[ev];
+  hist_add(&h[STAGE_SPAWN], t.spawn - t.dispatch);
+  hist_add(&h[STAGE_EXEC], t.exec - t.spawn);
+  hist_add(&h[STAGE_TOTAL], t.exec - t.recv);
+  TRACE(ML_EXEC, trace_str(events[ev].name), pid);
+
+  c->pid = pid;
+  c->pidfd = pidfd;
+  c->event = ev;
+  c->timing = t;
+  evloop_add(l->loop, &c->source, pidfd, reap_child, c);
+  return c;
+}
+
+static bool locker_alive(const struct locker *l) { return l->locker != NULL; }
+
+static void handle_event(struct locker *l, size_t ev, uint64_t recv) {
+  const struct event *e = &events[ev];
+  struct timing t = {.recv = recv, .dispatch = now_us()};
+  uint64_t now = t.dispatch / 1000;
+
+  hist_add(&l->latency[ev][STAGE_DISPATCH], t.dispatch - t.recv);
+  TRACE(ML_DISPATCH, trace_str(e->name), t.dispatch - t.recv);
+
+  switch (e->kind) {
+  case KIND_LOCK:
+  case KIND_SUSPEND:
+    if (e->kind == KIND_SUSPEND)
+      l->state = STATE_SUSPENDING;
+    else if (l->state == STATE_UNLOCKED)
+      l->state = STATE_LOCKED;
+
+    if (locker_alive(l)) {
+      TRACE(ML_SKIP, trace_str(e->name), trace_str("running"));
+      return;
+    }
+    if (l->last_lock_ms && now - l->last_lock_ms < l->coalesce_ms) {
+      TRACE(ML_SKIP, trace_str(e->name), trace_str("coalesced"));
+      return;
+    }
+
+    /* only a locker that was actually started opens the window, e.g. a Lock
+     * without a command must not swallow the PrepareForSleep after it */
+    l->locker = spawn_command(l, ev, t);
+    if (l->locker)
+      l->last_lock_ms = now;
+    break;
+
+  case KIND_RESUME:
+    if (l->state != STATE_SUSPENDING) {
+      TRACE(ML_SKIP, trace_str(e->name), trace_str("not-suspended"));
+      return;
+    }
+    l->state = locker_alive(l) ? STATE_LOCKED : STATE_UNLOCKED;
+    spawn_command(l, ev, t);
+    break;
+
+  case KIND_UNLOCK:
+    /* the dying locker stays in children[] until it is reaped, but a Lock
+     * right after this one must start a new locker */
+    if (locker_alive(l)) {
+      TRACE(ML_KILL, trace_str(e->name), l->locker->pid);
+      kill(-l->locker->pid, SIGTERM);
+      l->locker->killed = true;
+      l->locker = NULL;
+      l->last_lock_ms = 0;
+    }
+    if (l->state == STATE_UNLOCKED && l->last_unlock_ms &&
+        now - l->last_unlock_ms < l->coalesce_ms) {
+      TRACE(ML_SKIP, trace_str(e->name), trace_str("coalesced"));
+      return;
+    }
+
+    l->state = STATE_UNLOCKED;
+    spawn_command(l, ev, t);
+    l->last_unlock_ms = now;
+    break;
+
+  case KIND_OTHER:
+    if (l->last_ms[ev] && now - l->last_ms[ev] < l->coalesce_ms) {
+      TRACE(ML_SKIP, trace_str(e->name), trace_str("coalesced"));
+      return;
+    }
+    spawn_command(l, ev, t);
+    l->last_ms[ev] = now;
+    break;
+  }
+}
+
+/* signals with a single boolean argument (or none) */
+static void dispatch_signal(struct locker *l, const struct dispatch *d,
+                            DBusMessage *msg, uint64_t recv) {
+  dbus_bool_t value = false;
+  bool has_value = dbus_message_has_signature(msg, "b");
+
+  if (has_value)
+    dbus_message_get_args(msg, NULL, DBUS_TYPE_BOOLEAN, &value,
+                          DBUS_TYPE_INVALID);
+  else if (!dbus_message_has_signature(msg, ""))
+    return;
+
+  for (int i = 0; i < d->n_events; i++) {
+    const struct event *e = &events[d->events[i]];
+    if (e->value < 0 || (has_value && e->value == (value ? 1 : 0)))
+      handle_event(l, d->events[i], recv);
+  }
+}
+
+/* PropertiesChanged(s interface, a{sv} changed, as invalidated) */
+static void dispatch_properties(struct locker *l, const struct dispatch *d,
+                                DBusMessage *msg, uint64_t recv) {
+  DBusMessageIter iter, changed;
+  const char *interface;
+
+  /* the signature pins down every type the iteration below relies on */
+  if (!dbus_message_has_signature(msg, "sa{sv}as") ||
+      !dbus_message_iter_init(msg, &iter))
+    return;
+  dbus_message_iter_get_basic(&iter, &interface);
+  if (strcmp(interface, d->properties_interface) != 0)
+    return;
+  dbus_message_iter_next(&iter);
+
+  dbus_message_iter_recurse(&iter, &changed);
+  while (dbus_message_iter_get_arg_type(&changed) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entry, variant;
+    const char *name;
+    dbus_bool_t value;
+
+    dbus_message_iter_recurse(&changed, &entry);
+    dbus_message_iter_get_basic(&entry, &name);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_recurse(&entry, &variant);
+
+    if (dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_BOOLEAN) {
+      dbus_message_iter_get_basic(&variant, &value);
+      for (int i = 0; i < d->n_events; i++) {
+        const struct event *e = &events[d->events[i]];
+        if (strcmp(e->member, name) == 0 && e->value == (value ? 1 : 0))
+          handle_event(l, d->events[i], recv);
+      }
+    }
+
+    dbus_message_iter_next(&changed);
+  }
+}
+
+static void reap_child(void *data) {
+  struct child *c = data;
+  struct locker *l = c->owner;
+  int status;
+  if (!c->pid || waitpid(c->pid, &status, WNOHANG) <= 0)
+    return;
+
+  uint64_t run_us = now_us() - c->timing.exec;
+  hist_add(&l->latency[c->event][STAGE_RUN], run_us);
+  TRACE(ML_EXIT, c->pid, status);
+
+  const char *cmd = l->commands[c->event];
+  if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+    fprintf(stderr, "Command '%s' failed with code %d\n", cmd,
+            WEXITSTATUS(status));
+  else if (WIFSIGNALED(status) && c != l->locker && !c->killed)
+    fprintf(stderr, "Command '%s' killed by signal %d\n", cmd,
+            WTERMSIG(status));
+
+  if (l->locker == c) {
+    l->locker = NULL;
+    /* the locker exited on its own, i.e. the user has unlocked */
+    if (l->state == STATE_LOCKED)
+      l->state = STATE_UNLOCKED;
+  }
+
+  evloop_remove(l->loop, &c->source);
+  close(c->pidfd);
+  c->pid = 0;
+  c->pidfd = -1;
+  c->killed = false;
+}
+
+static uint64_t env_ms(const char *env, uint64_t fallback) {
+  const char *value = getenv(env);
+  if (value == NULL || value[0] == '\0')
+    return fallback;
+
+  char *end;
+  unsigned long long ms = strtoull(value, &end, 10);
+  if (*end != '\0') {
+    fprintf(stderr, "Invalid %s value '%s', using %" PRIu64 "\n", env, value,
+            fallback);
+    return fallback;
+  }
+  return ms;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s\n", prog);
+  exit(1);
+}
+
+/* handles the messages read from the bus, including those read while
+ * blocking for a reply */
+static int dispatch_messages(void *data) {
+  struct locker *l = data;
+  DBusMessage *msg;
+  while ((msg = dbus_connection_pop_message(l->conn)) != NULL) {
+    const struct dispatch *d = NULL;
+    if (dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS, "NameOwnerChanged"))
+      update_sender(l->senders, msg);
+    else if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL)
+      d = dispatch_lookup(l->table, msg);
+    if (d && !from_owner(l->senders, d, msg))
+      d = NULL;
+
+    if (d && d->properties_interface)
+      dispatch_properties(l, d, msg, l->recv);
+    else if (d)
+      dispatch_signal(l, d, msg, l->recv);
+
+    dbus_message_unref(msg);
+  }
+  return -1;
+}
+
+static void read_bus(void *data) {
+  struct locker *l = data;
+  if (!dbus_connection_read_write(l->conn, 0)) {
+    fprintf(stderr, "DBus connection closed\n");
+    evloop_quit(l->loop, 1);
+    return;
+  }
+  l->recv = now_us();
+}
+
+/* SIGUSR1 dumps the latency histograms */
+static void read_signal(void *data) {
+  struct locker *l = data;
+  struct signalfd_siginfo si;
+  if (read(l->sig_fd, &si, sizeof(si)) == sizeof(si))
+    dump_latency(l);
+}
+
+int micro_locker_start(struct evloop *loop, int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    /* still accepted, so that existing units keep working */
+    if (strcmp(argv[i], "--debug") != 0)
+      usage(argv[0]);
+    fprintf(stderr, "--debug is ignored, set TRACE_DIR instead\n");
+  }
+
+  static struct locker l;
+  if (l.loop) {
+    fprintf(stderr, "%s can only be started once\n", argv[0]);
+    return -1;
+  }
+  l.loop = loop;
+  l.state = STATE_UNLOCKED;
+  l.coalesce_ms = env_ms("COALESCE_MS", DEFAULT_COALESCE_MS);
+  for (int i = 0; i < MAX_CHILDREN; i++) {
+    l.children[i].pidfd = -1;
+    l.children[i].owner = &l;
+  }
+
+  load_config(l.commands);
+
+  DBusError err;
+  dbus_error_init(&err);
+
+  /* connect to the daemon bus */
+  l.conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+  if (!l.conn) {
+    fprintf(stderr, "Failed to get a session DBus connection: %s\n",
+            err.message);
+    return -1;
+  }
+
+  char *sessionId = get_session_id(l.conn);
+
+  /* lock state transitions are needed whenever there is a locker to track */
+  bool has_locker = false;
+  for (size_t i = 0; i < N_EVENTS; i++) {
+    if (l.commands[i] &&
+        (events[i].kind == KIND_LOCK || events[i].kind == KIND_SUSPEND))
+      has_locker = true;
+  }
+
+  for (size_t i = 0; i < N_EVENTS; i++) {
+    if (l.commands[i] || (has_locker && events[i].kind != KIND_OTHER))
+      dispatch_add(l.table, i, sessionId);
+  }
+  watch_senders(l.conn, l.table, l.senders);
+  dispatch_add_matches(l.conn, l.table);
+  dbus_connection_flush(l.conn);
+
+  int dbus_fd;
+  if (!dbus_connection_get_unix_fd(l.conn, &dbus_fd)) {
+    fprintf(stderr, "Unable to get the DBus connection fd\n");
+    return -1;
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  l.sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (l.sig_fd < 0) {
+    perror("signalfd");
+    return -1;
+  }
+
+  /* wait for the bus, SIGUSR1 or any of the running commands */
+  if (evloop_add(loop, &l.dbus_source, dbus_fd, read_bus, &l) < 0 ||
+      evloop_add(loop, &l.sig_source, l.sig_fd, read_signal, &l) < 0 ||
+      evloop_add_hook(loop, dispatch_messages, &l) < 0)
+    return -1;
+
+  l.recv = now_us();
+  TRACE(ML_LISTEN, getpid(), 0);
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef MICRO_LOCKER_H
+#define MICRO_LOCKER_H
+
+#include "evloop.h"
+
+/*
+ * Loads the config, connects to the system bus and registers with the loop.
+ * Returns -1 on errors, which are printed; exits with the usage on invalid
+ * arguments. Can only be started once per process.
+ *
+ * SIGUSR1 (dumping the latency histograms) is read from a signalfd, and is
+ * blocked in the calling thread only: threads that already exist keep their
+ * mask, and SIGUSR1's default action would kill the process if delivered to
+ * one of them. A process starting threads before this must block SIGUSR1
+ * first.
+ */
+int micro_locker_start(struct evloop *loop, int argc, char *argv[]);
+
+#endif
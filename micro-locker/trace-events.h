@@ -0,0 +1 @@
+../common/trace-events.h
\ No newline at end of file
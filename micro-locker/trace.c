@@ -0,0 +1 @@
+../common/trace.c
\ No newline at end of file
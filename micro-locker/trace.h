@@ -0,0 +1 @@
+../common/trace.h
\ No newline at end of file
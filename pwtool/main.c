@@ -0,0 +1,10 @@
+#include "pwtool.h"
+#include "trace.h"
+
+int main(int argc, char *argv[]) {
+  trace_init("pwtool");
+  struct evloop loop;
+  if (evloop_init(&loop) < 0 || pwtool_start(&loop, argc, argv) < 0)
+    return 1;
+  return evloop_run(&loop);
+}
@@ -4,7 +4,7 @@
  * Monitors default audio sink or source, outputs JSON for waybar or
  * i3status-rs. Replaces pa-input.sh / pa-output.sh shell scripts.
  *
- * Usage: pwtool [--i3statusrs] [--debug] <sink|source>
+ * Usage: pwtool [--i3statusrs] [-o fifo] <sink|source>
  */
 #include <pipewire/extensions/metadata.h>
 #include <pipewire/pipewire.h>
@@ -12,10 +12,18 @@
 #include <spa/pod/iter.h>
 #include <spa/pod/parser.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "pwtool.h"
+#include "trace.h"
 
 /* ── name remapping ──────────────────────────────────────────────── */
 
@@ -45,9 +53,15 @@ struct node_info {
 
 /* ── global state ────────────────────────────────────────────────── */
 
-struct state {
-  struct pw_main_loop *loop;
+/* one PipeWire connection, shared by all instances of the process */
+static struct {
+  struct pw_loop *loop;
   struct pw_context *context;
+  struct pw_core *core;
+  struct evloop_source source;
+} pw;
+
+struct state {
   struct pw_core *core;
   struct pw_registry *registry;
   struct spa_hook registry_listener;
@@ -73,7 +87,7 @@ struct state {
 
   /* output mode */
   bool i3statusrs;
-  bool debug;
+  int out_fd;
 
   /* roundtrip sync */
   int pending_seq;
@@ -97,16 +111,6 @@ static const char *map_name(const struct name_map *map, const char *desc) {
   return desc;
 }
 
-static void free_map(struct name_map *m) {
-  while (m) {
-    struct name_map *next = m->next;
-    free(m->key);
-    free(m->value);
-    free(m);
-    m = next;
-  }
-}
-
 /* ── config parser ───────────────────────────────────────────────── */
 
 /*
@@ -119,66 +123,14 @@ static void free_map(struct name_map *m) {
  * Supports \" escape inside quoted strings.
  */
 
-static char *parse_quoted(const char **p) {
-  if (**p != '"')
-    return NULL;
-  (*p)++; /* skip opening quote */
-
-  size_t cap = 64, len = 0;
-  char *buf = malloc(cap);
-  if (!buf)
-    return NULL;
-
-  while (**p && **p != '"') {
-    if (**p == '\\' && *(*p + 1) == '"') {
-      (*p)++; /* skip backslash */
-    }
-    if (len + 1 >= cap) {
-      cap *= 2;
-      char *tmp = realloc(buf, cap);
-      if (!tmp) {
-        free(buf);
-        return NULL;
-      }
-      buf = tmp;
-    }
-    buf[len++] = **p;
-    (*p)++;
-  }
-  if (**p == '"')
-    (*p)++;
-  buf[len] = '\0';
-  return buf;
-}
-
 static void load_config(struct state *s) {
-  const char *home = getenv("HOME");
-  if (!home)
-    return;
-
-  char path[512];
-  snprintf(path, sizeof(path), "%s/.config/pwtool/config", home);
-
-  FILE *f = fopen(path, "r");
-  if (!f)
+  struct config_file cf;
+  if (!config_open(&cf, "pwtool"))
     return;
 
   struct name_map **current = NULL;
-  char line[1024];
-
-  while (fgets(line, sizeof(line), f)) {
-    /* strip trailing newline */
-    size_t len = strlen(line);
-    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
-      line[--len] = '\0';
-
-    /* skip blank lines and comments */
-    const char *p = line;
-    while (*p == ' ' || *p == '\t')
-      p++;
-    if (*p == '\0' || *p == '#')
-      continue;
-
+  const char *p;
+  while ((p = config_next(&cf))) {
     /* section header */
     if (*p == '[') {
       if (strncmp(p, "[sink]", 6) == 0)
@@ -194,22 +146,20 @@ static void load_config(struct state *s) {
       continue;
 
     /* "key" = "value" */
-    char *key = parse_quoted(&p);
+    char *key = config_quoted(&p);
     if (!key)
       continue;
 
     /* skip whitespace and = */
-    while (*p == ' ' || *p == '\t')
-      p++;
+    config_skip_blanks(&p);
     if (*p != '=') {
       free(key);
       continue;
     }
     p++;
-    while (*p == ' ' || *p == '\t')
-      p++;
+    config_skip_blanks(&p);
 
-    char *value = parse_quoted(&p);
+    char *value = config_quoted(&p);
     if (!value) {
       free(key);
       continue;
@@ -221,15 +171,11 @@ static void load_config(struct state *s) {
     entry->next = *current;
     *current = entry;
   }
-  fclose(f);
-
-  if (s->debug) {
-    fprintf(stderr, "[config] loaded from %s\n", path);
-    for (const struct name_map *m = s->sink_map; m; m = m->next)
-      fprintf(stderr, "[config] sink: \"%s\" -> \"%s\"\n", m->key, m->value);
-    for (const struct name_map *m = s->source_map; m; m = m->next)
-      fprintf(stderr, "[config] source: \"%s\" -> \"%s\"\n", m->key, m->value);
-  }
+
+  TRACE(PW_CONFIG, trace_str(cf.path), 0);
+  for (const struct name_map *m = s->source_mode ? s->source_map : s->sink_map;
+       m; m = m->next)
+    TRACE(PW_MAP, trace_str(m->key), trace_str(m->value));
 }
 
 /* ── JSON output ─────────────────────────────────────────────────── */
@@ -253,6 +199,48 @@ static void json_escape(const char *in, char *out, size_t out_size) {
   out[j] = '\0';
 }
 
+/*
+ * -o outputs are FIFOs opened read-write, so that writing neither blocks nor
+ * raises SIGPIPE while no one reads. They only ever hold the latest line, a
+ * reader coming later gets the current status rather than the backlog.
+ */
+static int open_output(const char *path) {
+  if (mkfifo(path, 0600) < 0 && errno != EEXIST) {
+    perror(path);
+    return -1;
+  }
+  int fd = open(path, O_RDWR | O_NONBLOCK | O_APPEND | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  /* anything else at that path (e.g. a regular file left behind) can't be
+   * drained and would grow with every line */
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+    fprintf(stderr, "%s: not a FIFO\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void write_line(struct state *s, const char *buf) {
+  char line[sizeof(s->last_output) + 1];
+  size_t len = snprintf(line, sizeof(line), "%s\n", buf);
+
+  /* drop the lines no one has read yet, lines are shorter than PIPE_BUF
+   * and written whole */
+  if (s->out_fd != STDOUT_FILENO) {
+    char stale[4096];
+    while (read(s->out_fd, stale, sizeof(stale)) > 0)
+      ;
+  }
+  if (write(s->out_fd, line, len) < 0 && errno != EAGAIN)
+    perror("write");
+}
+
 static void output_status(struct state *s) {
   /* find current default node */
   const char *target_name =
@@ -348,9 +336,7 @@ static void output_status(struct state *s) {
   if (strcmp(buf, s->last_output) == 0)
     return;
   memcpy(s->last_output, buf, strlen(buf) + 1);
-
-  puts(buf);
-  fflush(stdout);
+  write_line(s, buf);
 }
 
 /* ── node events ─────────────────────────────────────────────────── */
@@ -405,9 +391,7 @@ static void node_event_param(void *data, int seq, uint32_t id, uint32_t index,
       spa_pod_get_bool(&prop->value, &muted);
       if (ni->muted != muted) {
         ni->muted = muted;
-        if (s->debug)
-          fprintf(stderr, "[node %u] mute -> %s\n", ni->id,
-                  muted ? "true" : "false");
+        TRACE(PW_MUTE, ni->id, muted);
         if (s->initial_sync_done)
           output_status(s);
       }
@@ -453,8 +437,7 @@ static void subscribe_default_node(struct state *s) {
       uint32_t params[] = {SPA_PARAM_Props};
       pw_node_subscribe_params((struct pw_node *)n->proxy, params, 1);
       n->subscribed = true;
-      if (s->debug)
-        fprintf(stderr, "[subscribe] node %u (%s)\n", n->id, n->name);
+      TRACE(PW_SUBSCRIBE, n->id, trace_str(n->name));
     }
   }
 }
@@ -487,8 +470,7 @@ static void registry_global(void *data, uint32_t id, uint32_t permissions,
     }
     s->metadata = pw_registry_bind(s->registry, id, PW_TYPE_INTERFACE_Metadata,
                                    PW_VERSION_METADATA, 0);
-    if (s->debug)
-      fprintf(stderr, "[metadata] bound id=%u\n", id);
+    TRACE(PW_METADATA, id, 0);
     return;
   }
 
@@ -531,9 +513,7 @@ static void registry_global(void *data, uint32_t id, uint32_t permissions,
   ni->next = s->nodes;
   s->nodes = ni;
 
-  if (s->debug)
-    fprintf(stderr, "[node +] id=%u class=%s name=%s desc=%s\n", id, mc,
-            name ? name : "(null)", desc ? desc : "(null)");
+  TRACE(PW_NODE_ADD, id, trace_str(name ? name : "(null)"));
 
   if (s->initial_sync_done) {
     subscribe_default_node(s);
@@ -549,9 +529,7 @@ static void registry_global_remove(void *data, uint32_t id) {
     struct node_info *n = *pp;
     if (n->id == id) {
       *pp = n->next;
-      if (s->debug)
-        fprintf(stderr, "[node -] id=%u name=%s\n", id,
-                n->name ? n->name : "(null)");
+      TRACE(PW_NODE_REMOVE, id, trace_str(n->name ? n->name : "(null)"));
       if (n->proxy)
         pw_proxy_destroy(n->proxy);
       free(n->name);
@@ -616,9 +594,8 @@ static int metadata_property(void *data, uint32_t subject, const char *key,
     extract_metadata_name(value, s->default_sink_name,
                           sizeof(s->default_sink_name));
     changed = strcmp(old, s->default_sink_name) != 0;
-    if (s->debug && changed)
-      fprintf(stderr, "[metadata] default.audio.sink = %s\n",
-              s->default_sink_name);
+    if (changed)
+      TRACE(PW_DEFAULT, trace_str("sink"), trace_str(s->default_sink_name));
   } else if (strcmp(key, "default.audio.source") == 0) {
     char old[512];
     strncpy(old, s->default_source_name, sizeof(old));
@@ -626,9 +603,9 @@ static int metadata_property(void *data, uint32_t subject, const char *key,
     extract_metadata_name(value, s->default_source_name,
                           sizeof(s->default_source_name));
     changed = strcmp(old, s->default_source_name) != 0;
-    if (s->debug && changed)
-      fprintf(stderr, "[metadata] default.audio.source = %s\n",
-              s->default_source_name);
+    if (changed)
+      TRACE(PW_DEFAULT, trace_str("source"),
+            trace_str(s->default_source_name));
   }
 
   if (changed && s->initial_sync_done) {
@@ -654,8 +631,7 @@ static void core_done(void *data, uint32_t id, int seq) {
 
   if (!s->initial_sync_done) {
     s->initial_sync_done = true;
-    if (s->debug)
-      fprintf(stderr, "[core] initial sync done\n");
+    TRACE(PW_SYNC, 0, 0);
 
     /* now add metadata listener if we have metadata */
     if (s->metadata) {
@@ -681,25 +657,49 @@ static const struct pw_core_events core_events = {
 /* ── main ────────────────────────────────────────────────────────── */
 
 static void usage(const char *prog) {
-  fprintf(stderr, "Usage: %s [--i3statusrs] [--debug] <sink|source>\n", prog);
+  fprintf(stderr, "Usage: %s [--i3statusrs] [-o fifo] <sink|source>\n", prog);
   exit(1);
 }
 
-int main(int argc, char *argv[]) {
-  struct state s = {0};
+static void iterate_pipewire(void *data) { pw_loop_iterate(pw.loop, 0); }
+
+static int connect_pipewire(struct evloop *loop) {
+  pw_init(NULL, NULL);
+
+  pw.loop = pw_loop_new(NULL);
+  pw.context = pw.loop ? pw_context_new(pw.loop, NULL, 0) : NULL;
+  pw.core = pw.context ? pw_context_connect(pw.context, NULL, 0) : NULL;
+  if (!pw.core) {
+    fprintf(stderr, "error: can't connect to PipeWire\n");
+    return -1;
+  }
+
+  /* the loop is only ever iterated from here */
+  pw_loop_enter(pw.loop);
+  return evloop_add(loop, &pw.source, pw_loop_get_fd(pw.loop), iterate_pipewire,
+                    NULL);
+}
+
+int pwtool_start(struct evloop *loop, int argc, char *argv[]) {
+  struct state *s = calloc(1, sizeof(*s));
+  s->out_fd = STDOUT_FILENO;
 
   /* parse args */
   bool got_mode = false;
+  const char *output = NULL;
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--i3statusrs") == 0) {
-      s.i3statusrs = true;
+      s->i3statusrs = true;
     } else if (strcmp(argv[i], "--debug") == 0) {
-      s.debug = true;
+      /* still accepted, so that existing bar configs keep working */
+      fprintf(stderr, "--debug is ignored, set TRACE_DIR instead\n");
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
     } else if (strcmp(argv[i], "sink") == 0) {
-      s.source_mode = false;
+      s->source_mode = false;
       got_mode = true;
     } else if (strcmp(argv[i], "source") == 0) {
-      s.source_mode = true;
+      s->source_mode = true;
       got_mode = true;
     } else {
       usage(argv[0]);
@@ -708,51 +708,21 @@ int main(int argc, char *argv[]) {
   if (!got_mode)
     usage(argv[0]);
 
-  load_config(&s);
+  if (output && (s->out_fd = open_output(output)) < 0)
+    return -1;
+  load_config(s);
 
-  pw_init(&argc, &argv);
+  if (!pw.core && connect_pipewire(loop) < 0)
+    return -1;
+  s->core = pw.core;
 
-  s.loop = pw_main_loop_new(NULL);
-  s.context = pw_context_new(pw_main_loop_get_loop(s.loop), NULL, 0);
-  s.core = pw_context_connect(s.context, NULL, 0);
-  if (!s.core) {
-    fprintf(stderr, "error: can't connect to PipeWire\n");
-    return 1;
-  }
-
-  pw_core_add_listener(s.core, &s.core_listener, &core_events, &s);
+  pw_core_add_listener(s->core, &s->core_listener, &core_events, s);
 
-  s.registry = pw_core_get_registry(s.core, PW_VERSION_REGISTRY, 0);
-  pw_registry_add_listener(s.registry, &s.registry_listener, &registry_events,
-                           &s);
+  s->registry = pw_core_get_registry(s->core, PW_VERSION_REGISTRY, 0);
+  pw_registry_add_listener(s->registry, &s->registry_listener,
+                           &registry_events, s);
 
   /* trigger roundtrip to wait for initial globals */
-  s.pending_seq = pw_core_sync(s.core, PW_ID_CORE, 0);
-
-  pw_main_loop_run(s.loop);
-
-  /* cleanup */
-  while (s.nodes) {
-    struct node_info *n = s.nodes;
-    s.nodes = n->next;
-    if (n->proxy)
-      pw_proxy_destroy(n->proxy);
-    free(n->name);
-    free(n->description);
-    free(n->media_class);
-    free(n);
-  }
-
-  if (s.metadata)
-    pw_proxy_destroy(s.metadata);
-  pw_proxy_destroy((struct pw_proxy *)s.registry);
-  pw_core_disconnect(s.core);
-  pw_context_destroy(s.context);
-  pw_main_loop_destroy(s.loop);
-  pw_deinit();
-
-  free_map(s.sink_map);
-  free_map(s.source_map);
-
+  s->pending_seq = pw_core_sync(s->core, PW_ID_CORE, 0);
   return 0;
 }
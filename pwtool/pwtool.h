@@ -0,0 +1,13 @@
+#ifndef PWTOOL_H
+#define PWTOOL_H
+
+#include "evloop.h"
+
+/*
+ * Starts one status output; all instances of a process share one PipeWire
+ * connection. Returns -1 on errors, which are printed; exits with the usage
+ * on invalid arguments.
+ */
+int pwtool_start(struct evloop *loop, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * trace-decode - prints the trace rings written by the tools (see
+ * common/trace.h), records of all given files merged by timestamp:
+ *
+ *   <CLOCK_MONOTONIC seconds> <name>[<pid>] <event> <arg>=<value>...
+ *
+ * Usage: trace-decode <trace file>...
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+struct entry {
+  const struct trace_map *map;
+  struct trace_record record;
+};
+
+static int cmp_entry(const void *a, const void *b) {
+  const struct entry *x = a, *y = b;
+  if (x->record.ts != y->record.ts)
+    return x->record.ts < y->record.ts ? -1 : 1;
+  return x->record.seq < y->record.seq ? -1 : x->record.seq > y->record.seq;
+}
+
+static void print_arg(const struct trace_map *m, const char *name, char kind,
+                      uint64_t value) {
+  switch (kind) {
+  case 'u':
+    printf(" %s=%" PRIu64, name, value);
+    break;
+  case 'd':
+    printf(" %s=%" PRId64, name, (int64_t)value);
+    break;
+  case 'x':
+    printf(" %s=0x%" PRIx64, name, value);
+    break;
+  case 's':
+    printf(" %s=\"%s\"", name, trace_map_string(m, value));
+    break;
+  }
+}
+
+static void print_entry(const struct entry *e) {
+  const struct trace_header *hdr = e->map->hdr;
+  const struct trace_record *r = &e->record;
+  const struct trace_event_info *info = &trace_events[r->event];
+
+  printf("%" PRIu64 ".%06" PRIu64 " %.*s[%d] %s", r->ts / 1000000000,
+         r->ts % 1000000000 / 1000, (int)sizeof(hdr->name), hdr->name,
+         hdr->pid, info->name);
+  for (int i = 0; i < 2; i++)
+    print_arg(e->map, info->arg_names[i], info->arg_kinds[i], r->args[i]);
+  putchar('\n');
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <trace file>...\n", argv[0]);
+    return 1;
+  }
+
+  int n_maps = argc - 1;
+  struct trace_map *maps = calloc(n_maps, sizeof(*maps));
+  size_t n = 0, cap = 0;
+  struct entry *entries = NULL;
+
+  for (int i = 0; i < n_maps; i++) {
+    struct trace_map *m = &maps[i];
+    if (trace_map_open(argv[i + 1], m) < 0) {
+      fprintf(stderr, "%s: not a trace\n", argv[i + 1]);
+      continue;
+    }
+
+    uint64_t head = trace_map_head(m);
+    uint64_t first = head > m->hdr->capacity ? head - m->hdr->capacity + 1 : 1;
+    if (first > 1)
+      fprintf(stderr, "%s: %" PRIu64 " older records were overwritten\n",
+              argv[i + 1], first - 1);
+
+    for (uint64_t seq = first; seq <= head; seq++) {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 1024;
+        entries = realloc(entries, cap * sizeof(*entries));
+      }
+      entries[n].map = m;
+      if (trace_map_get(m, seq, &entries[n].record))
+        n++;
+    }
+  }
+
+  qsort(entries, n, sizeof(*entries), cmp_entry);
+  for (size_t i = 0; i < n; i++)
+    print_entry(&entries[i]);
+
+  for (int i = 0; i < n_maps; i++) {
+    if (maps[i].hdr)
+      trace_map_close(&maps[i]);
+  }
+  free(entries);
+  free(maps);
+  return 0;
+}
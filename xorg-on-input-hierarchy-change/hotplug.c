@@ -0,0 +1,448 @@
+#include "hotplug.h"
+#include "trace.h"
+
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/pidfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+// Adaptive mode never goes below this quiet window
+#define ADAPTIVE_MIN_MS 8
+// A burst starting within this many windows after a run is assumed to be
+// the tail of the previous physical plug, split by a too short window
+#define ADAPTIVE_SPLIT_FACTOR 4
+
+static void debounce_arm(struct debounce *d) {
+    uint64_t deadline = d->last_us + d->window_us;
+    if (deadline > d->first_us + d->max_wait_us) {
+        deadline = d->first_us + d->max_wait_us;
+    }
+
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = deadline / 1000000,
+            .tv_nsec = (deadline % 1000000) * 1000,
+        },
+    };
+    if (timerfd_settime(d->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+static void debounce_event(struct debounce *d, uint64_t now) {
+    if (!d->pending) {
+        if (d->adaptive && d->last_fire_us &&
+            now - d->last_fire_us < d->window_us * ADAPTIVE_SPLIT_FACTOR) {
+            // the previous run fired in the middle of a burst
+            uint64_t gap = now - d->last_us;
+            if (gap > d->max_gap_us) {
+                d->max_gap_us = gap;
+            }
+        } else {
+            d->max_gap_us = 0;
+        }
+        d->pending = true;
+        d->first_us = now;
+        d->events = 0;
+        TRACE(HP_DEBOUNCE, d->window_us, 0);
+    } else if (now - d->last_us > d->max_gap_us) {
+        d->max_gap_us = now - d->last_us;
+    }
+
+    d->last_us = now;
+    d->events++;
+    debounce_arm(d);
+}
+
+// Returns true once the window has passed without new events
+static bool debounce_expired(struct debounce *d) {
+    uint64_t expirations;
+    if (read(d->tfd, &expirations, sizeof(expirations)) < 0 || !d->pending) {
+        return false;
+    }
+
+    uint64_t now = now_us();
+    d->pending = false;
+    d->last_fire_us = now;
+    TRACE(HP_DEBOUNCED, d->events, now - d->first_us);
+
+    if (d->adaptive && d->max_gap_us) {
+        // Twice the largest gap seen within a burst, smoothed over bursts
+        uint64_t target = d->max_gap_us * 2;
+        uint64_t window = (d->window_us * 3 + target) / 4;
+        if (window < ADAPTIVE_MIN_MS * 1000) {
+            window = ADAPTIVE_MIN_MS * 1000;
+        }
+        if (window > d->max_wait_us) {
+            window = d->max_wait_us;
+        }
+        d->window_us = window;
+    }
+    return true;
+}
+
+struct device_change *changes_add(struct changes *c, int id, bool present) {
+    for (int i = 0; i < c->count; i++) {
+        if (c->devices[i].id == id) {
+            c->devices[i].present = present;
+            return &c->devices[i];
+        }
+    }
+    if (c->count == MAX_CHANGES) {
+        return NULL;
+    }
+
+    struct device_change *dc = &c->devices[c->count++];
+    dc->id = id;
+    dc->present = present;
+    dc->name[0] = '\0';
+    return dc;
+}
+
+static void changes_merge(struct changes *into, const struct changes *from) {
+    for (int i = 0; i < from->count; i++) {
+        const struct device_change *src = &from->devices[i];
+        struct device_change *dc = changes_add(into, src->id, src->present);
+        if (dc && src->name[0]) {
+            memcpy(dc->name, src->name, sizeof(dc->name));
+        }
+    }
+}
+
+// Space separated ids and newline separated names of the changed devices,
+// the n-th name belonging to the n-th added id
+struct command_env {
+    char added_ids[MAX_CHANGES * 12 + 1];
+    char removed_ids[MAX_CHANGES * 12 + 1];
+    char added_names[MAX_CHANGES * MAX_DEVICE_NAME];
+};
+
+static void build_env(const struct changes *c, struct command_env *env) {
+    size_t added = 0, removed = 0, names = 0;
+    env->added_ids[0] = env->removed_ids[0] = env->added_names[0] = '\0';
+
+    for (int i = 0; i < c->count; i++) {
+        const struct device_change *dc = &c->devices[i];
+        if (!dc->present) {
+            removed += snprintf(env->removed_ids + removed,
+                                sizeof(env->removed_ids) - removed, "%s%d",
+                                removed ? " " : "", dc->id);
+            continue;
+        }
+
+        // names stay aligned with the ids, an unknown one is an empty line
+        names += snprintf(env->added_names + names,
+                          sizeof(env->added_names) - names, "%s%s",
+                          added ? "\n" : "", dc->name);
+        added += snprintf(env->added_ids + added,
+                          sizeof(env->added_ids) - added, "%s%d",
+                          added ? " " : "", dc->id);
+    }
+}
+
+extern char **environ;
+
+static char *env_var(const char *name, const char *value) {
+    size_t len = strlen(name) + strlen(value) + 2;
+    char *var = malloc(len);
+    snprintf(var, len, "%s=%s", name, value);
+    return var;
+}
+
+// Whether two NAME=value entries set the same variable
+static bool env_same(const char *a, const char *b) {
+    size_t len = strcspn(a, "=");
+    return strncmp(a, b, len) == 0 && b[len] == '=';
+}
+
+// Our environment with the given variables replaced or added. Built before
+// spawning, as other modules' threads (PipeWire's in desktop-eventd) make
+// allocating between fork and exec unsafe.
+static char **command_envp(char **vars, int n_vars) {
+    int n = 0;
+    while (environ[n]) {
+        n++;
+    }
+    char **envp = malloc((n + n_vars + 1) * sizeof(*envp));
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        bool replaced = false;
+        for (int j = 0; j < n_vars && !replaced; j++) {
+            replaced = env_same(vars[j], environ[i]);
+        }
+        if (!replaced) {
+            envp[count++] = environ[i];
+        }
+    }
+    for (int j = 0; j < n_vars; j++) {
+        envp[count++] = vars[j];
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+static void runner_exited(void *data);
+
+static void runner_start(struct runner *r) {
+    struct command_env env;
+    build_env(&r->pending, &env);
+    int devices = r->pending.count;
+    r->pending.count = 0;
+    r->rerun = false;
+
+    char *vars[] = {
+        env_var("INPUT_ADDED_IDS", env.added_ids),
+        env_var("INPUT_ADDED_NAMES", env.added_names),
+        env_var("INPUT_REMOVED_IDS", env.removed_ids),
+        r->display ? env_var("DISPLAY", r->display) : NULL,
+    };
+    int n_vars = r->display ? 4 : 3;
+    char **envp = command_envp(vars, n_vars);
+
+    // own process group, so that a timeout kills the whole script, and
+    // without the signals blocked for signalfds of other modules
+    sigset_t empty;
+    sigemptyset(&empty);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &empty);
+
+    pid_t pid;
+    int res = posix_spawnp(&pid, r->argv[0], NULL, &attr, r->argv, envp);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+    for (int i = 0; i < n_vars; i++) {
+        free(vars[i]);
+    }
+    if (res != 0) {
+        fprintf(stderr, "Unable to run %s: %s\n", r->argv[0], strerror(res));
+        return;
+    }
+
+    int pidfd = pidfd_open(pid, 0);
+    if (pidfd < 0) {
+        // can't supervise it, fall back to waiting for it
+        perror("pidfd_open");
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    r->pid = pid;
+    r->pidfd = pidfd;
+    evloop_add(r->loop, &r->pid_source, pidfd, runner_exited, r);
+    TRACE(HP_RUN, pid, devices);
+
+    if (r->timeout_us) {
+        struct itimerspec its = {
+            .it_value = {
+                .tv_sec = r->timeout_us / 1000000,
+                .tv_nsec = (r->timeout_us % 1000000) * 1000,
+            },
+        };
+        timerfd_settime(r->tfd, 0, &its, NULL);
+    }
+}
+
+// Called when a burst is over: runs the command now, or once the current
+// run exits
+static void runner_request(struct runner *r, const struct changes *burst) {
+    changes_merge(&r->pending, burst);
+    if (r->pid) {
+        TRACE(HP_RERUN, r->pid, 0);
+        r->rerun = true;
+        return;
+    }
+    runner_start(r);
+}
+
+static void runner_exited(void *data) {
+    struct runner *r = data;
+    int status;
+    if (!r->pid || waitpid(r->pid, &status, WNOHANG) <= 0) {
+        return;
+    }
+    TRACE(HP_EXIT, r->pid, status);
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Command failed with code %d\n", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        fprintf(stderr, "Command killed by signal %d\n", WTERMSIG(status));
+    }
+
+    evloop_remove(r->loop, &r->pid_source);
+    close(r->pidfd);
+    r->pid = 0;
+    r->pidfd = -1;
+    struct itimerspec disarm = {0};
+    timerfd_settime(r->tfd, 0, &disarm, NULL);
+
+    if (r->rerun) {
+        runner_start(r);
+    }
+}
+
+static void runner_timeout(void *data) {
+    struct runner *r = data;
+    uint64_t expirations;
+    if (read(r->tfd, &expirations, sizeof(expirations)) < 0 || !r->pid) {
+        return;
+    }
+    fprintf(stderr, "Command timed out, killing it\n");
+    kill(-r->pid, SIGKILL);
+}
+
+// backend specific options of the current parse, for the usage
+static const struct hotplug_opts *backend_opts;
+
+void hotplug_usage(const char *prog, bool command_required) {
+    fprintf(stderr,
+            "Usage: %s [-d debounce_ms] [-m max_wait_ms] [-a] [-k] [-A] [-t timeout_ms] [-f] %s%s\n"
+            "  -d  quiet time after the last event before running (default %d)\n"
+            "  -m  maximum time to wait after the first event (default %d)\n"
+            "  -a  adapt the quiet time to the observed bursts, -d is the initial value\n"
+            "  -k  only react to keyboards\n"
+            "  -A  only react to added or enabled devices\n"
+            "  -t  kill the command if it runs longer than this\n"
+            "  -f  run for every burst, also for removals only and configured devices\n"
+            "%s",
+            prog, backend_opts ? backend_opts->synopsis : "",
+            command_required ? "<command> [args...]" : "[command [args...]]",
+            DEBOUNCE_MS, MAX_WAIT_MS, backend_opts ? backend_opts->help : "");
+    exit(1);
+}
+
+void hotplug_parse_args(struct hotplug *h, int argc, char **argv,
+                        bool command_required,
+                        const struct hotplug_opts *opts) {
+    backend_opts = opts;
+    h->deb.window_us = DEBOUNCE_MS * 1000;
+    h->deb.max_wait_us = MAX_WAIT_MS * 1000;
+
+    // '+': options end at the command
+    char optstring[64];
+    snprintf(optstring, sizeof(optstring), "+d:m:akAt:f%s",
+             opts ? opts->letters : "");
+
+    int opt;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        switch (opt) {
+        case 'd':
+            h->deb.window_us = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'm':
+            h->deb.max_wait_us = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'a':
+            h->deb.adaptive = true;
+            break;
+        case 'k':
+            h->keyboards_only = true;
+            break;
+        case 'A':
+            h->added_only = true;
+            break;
+        case 't':
+            h->runner.timeout_us = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'f':
+            h->force = true;
+            break;
+        default:
+            if (opt == '?' || !opts || !opts->handle(opt, optarg, opts->data)) {
+                hotplug_usage(argv[0], command_required);
+            }
+        }
+    }
+
+    h->runner.argv = optind < argc ? &argv[optind] : NULL;
+    if (command_required && !h->runner.argv) {
+        hotplug_usage(argv[0], command_required);
+    }
+}
+
+static void hotplug_debounced(void *data) {
+    struct hotplug *h = data;
+    if (debounce_expired(&h->deb)) {
+        h->on_burst(h, h->data);
+    }
+}
+
+int hotplug_init(struct hotplug *h, struct evloop *loop,
+                 void (*on_burst)(struct hotplug *h, void *data), void *data) {
+    h->on_burst = on_burst;
+    h->data = data;
+    h->runner.loop = loop;
+    h->runner.pidfd = -1;
+    h->deb.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    h->runner.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (h->deb.tfd < 0 || h->runner.tfd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    // the timeout only fires while the command runs
+    if (evloop_add(loop, &h->deb_source, h->deb.tfd, hotplug_debounced, h) < 0 ||
+        evloop_add(loop, &h->runner.timeout_source, h->runner.tfd,
+                   runner_timeout, &h->runner) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+struct device_change *hotplug_event(struct hotplug *h, int id, bool present) {
+    TRACE(HP_DEVICE, id, present);
+    debounce_event(&h->deb, now_us());
+    return changes_add(&h->burst, id, present);
+}
+
+static const struct device_state *device_set_find(const struct device_set *set,
+                                                  int id) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->devices[i].id == id) {
+            return &set->devices[i];
+        }
+    }
+    return NULL;
+}
+
+bool hotplug_narrow(struct hotplug *h, const struct device_set *set) {
+    struct changes *c = &h->burst;
+    int kept = 0, added = 0, skipped = 0;
+    for (int i = 0; i < c->count; i++) {
+        struct device_change *dc = &c->devices[i];
+        // masters and devices already gone again aren't in the set
+        const struct device_state *d = device_set_find(set, dc->id);
+        if (dc->present && d) {
+            if (d->marked && !h->force) {
+                skipped++;
+                continue;
+            }
+            snprintf(dc->name, sizeof(dc->name), "%s", d->name);
+        }
+        added += dc->present;
+        c->devices[kept++] = *dc;
+    }
+    c->count = kept;
+
+    TRACE(HP_NARROW, kept, skipped);
+    // Removing devices leaves the settings of the others alone, so a burst
+    // of only removals (like the first half of a flapping device) is skipped
+    if (!h->force && !added) {
+        TRACE(HP_UNCHANGED, 0, 0);
+        c->count = 0;
+        return false;
+    }
+    return true;
+}
+
+void hotplug_run(struct hotplug *h) {
+    if (h->runner.argv) {
+        runner_request(&h->runner, &h->burst);
+    }
+    h->burst.count = 0;
+}
@@ -0,0 +1,144 @@
+// Backend independent part of the input hotplug watchers: trailing-edge
+// debounce of device events, the set of devices changed during a burst and
+// asynchronous execution of the command.
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "clock.h"
+#include "evloop.h"
+
+#define DEBOUNCE_MS 64
+#define MAX_WAIT_MS 1000
+
+#define MAX_DISPLAYS 16
+#define MAX_CHANGES 64
+#define MAX_DEVICES 128
+#define MAX_DEVICE_NAME 128
+
+// Property the backends set on devices once they were handed to the actions
+// and the command. It goes away with the device, so a device that flapped
+// comes back unmarked even if it gets the same id.
+#define APPLIED_MARKER "_XORG_ON_INPUT_HIERARCHY_CHANGE_APPLIED"
+
+// Trailing-edge debounce: every event pushes the deadline to last event +
+// window, but never past first event + max_wait. In adaptive mode the window
+// follows the largest gap seen within bursts.
+struct debounce {
+    int tfd;
+    uint64_t window_us;
+    uint64_t max_wait_us;
+    bool adaptive;
+
+    bool pending;
+    uint64_t first_us;
+    uint64_t last_us;
+    uint64_t max_gap_us;
+    uint64_t last_fire_us;
+    int events;
+};
+
+// Devices affected by the events of one or more bursts
+struct device_change {
+    int id;
+    bool present;
+    // filled in by the backend once the burst is over, empty if unknown
+    char name[MAX_DEVICE_NAME];
+};
+
+struct changes {
+    struct device_change devices[MAX_CHANGES];
+    int count;
+};
+
+// The command runs asynchronously, supervised through a pidfd in the event
+// loop. Changes seen while it runs are coalesced into one rerun once it
+// exits, and a hung command is killed after the optional timeout.
+struct runner {
+    char **argv;
+    // DISPLAY for the command, NULL to inherit ours
+    const char *display;
+    pid_t pid; // 0 when idle
+    int pidfd;
+    int tfd;
+    uint64_t timeout_us;
+    struct evloop *loop;
+    struct evloop_source pid_source;
+    struct evloop_source timeout_source;
+
+    // changes not yet seen by a run, and whether a run is owed for them
+    struct changes pending;
+    bool rerun;
+};
+
+// Slave devices as seen after a burst
+struct device_state {
+    int id;
+    bool marked;
+    char name[MAX_DEVICE_NAME];
+};
+
+struct device_set {
+    struct device_state devices[MAX_DEVICES];
+    int count;
+};
+
+struct hotplug {
+    struct debounce deb;
+    struct runner runner;
+    // devices changed in the current burst
+    struct changes burst;
+
+    // filters, applied by the backends
+    bool keyboards_only;
+    bool added_only;
+
+    // -f: run for every burst, ignoring the markers
+    bool force;
+
+    struct evloop_source deb_source;
+    // called when a burst is over, see hotplug_init()
+    void (*on_burst)(struct hotplug *h, void *data);
+    void *data;
+};
+
+struct device_change *changes_add(struct changes *c, int id, bool present);
+
+// Options of a single backend, on top of the common ones
+struct hotplug_opts {
+    const char *letters;  // for getopt
+    const char *synopsis; // for the usage line, with a trailing space
+    const char *help;     // usage lines
+    // returns false for invalid arguments
+    bool (*handle)(int opt, char *arg, void *data);
+    void *data;
+};
+
+// Parses the common options and the backend's ones (opts may be NULL),
+// exits with the usage on errors. The command is left in h->runner.argv,
+// NULL if none was given.
+void hotplug_parse_args(struct hotplug *h, int argc, char **argv,
+                        bool command_required,
+                        const struct hotplug_opts *opts);
+void hotplug_usage(const char *prog, bool command_required);
+// Creates the timers and registers them with the loop. on_burst is called
+// when a burst is over: the backend then snapshots the devices for
+// hotplug_narrow(), applies its own actions, marks the devices and calls
+// hotplug_run().
+int hotplug_init(struct hotplug *h, struct evloop *loop,
+                 void (*on_burst)(struct hotplug *h, void *data), void *data);
+
+// Records a device change and (re)starts the debounce window. Returns the
+// burst's entry for the device, NULL if the burst is full.
+struct device_change *hotplug_event(struct hotplug *h, int id, bool present);
+
+// Drops already marked devices from the burst and fills in the names.
+// Returns false when nothing is left to do: no device was added, or all the
+// added ones are still marked.
+bool hotplug_narrow(struct hotplug *h, const struct device_set *set);
+void hotplug_run(struct hotplug *h);
+
+#endif
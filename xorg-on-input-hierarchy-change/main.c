@@ -0,0 +1,11 @@
+#include "trace.h"
+#include "xorg-on-input-hierarchy-change.h"
+
+int main(int argc, char **argv) {
+    trace_init("xorg-on-input-hierarchy-change");
+    struct evloop loop;
+    if (evloop_init(&loop) < 0 || xorg_input_start(&loop, argc, argv) < 0) {
+        return 1;
+    }
+    return evloop_run(&loop);
+}
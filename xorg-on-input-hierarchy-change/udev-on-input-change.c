@@ -0,0 +1,437 @@
+// udev backend: runs the command when input devices come and go, from the
+// uevents udevd broadcasts after rule processing, so it works without Xorg
+// (e.g. under Wayland compositors). Only libc is needed: the netlink socket
+// is read directly, with a BPF filter dropping everything but the input
+// subsystem in the kernel.
+//
+// Devices are identified by N of their /dev/input/eventN node.
+#define _GNU_SOURCE // struct ucred
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#include "hotplug.h"
+#include "trace.h"
+
+// Multicast group of udevd's processed events, 1 is the raw kernel ones
+#define UDEV_MONITOR_GROUP 2
+#define UDEV_MONITOR_MAGIC 0xfeedcafe
+#define INPUT_EVENT_PREFIX "/dev/input/event"
+#define UEVENT_SIZE 8192
+
+// Header libudev puts in front of the properties (libudev-monitor.c)
+struct udev_header {
+    char prefix[8]; // "libudev"
+    uint32_t magic; // big endian
+    uint32_t header_size;
+    uint32_t properties_off;
+    uint32_t properties_len;
+    // big endian MurmurHash2 of the subsystem, for socket filters
+    uint32_t filter_subsystem_hash;
+    uint32_t filter_devtype_hash;
+    uint32_t filter_tag_bloom_hi;
+    uint32_t filter_tag_bloom_lo;
+};
+
+// MurmurHash2 as used by libudev, seed 0
+static uint32_t murmurhash2(const char *key) {
+    const uint32_t m = 0x5bd1e995;
+    size_t len = strlen(key);
+    const unsigned char *data = (const unsigned char *)key;
+    uint32_t h = len;
+
+    while (len >= 4) {
+        uint32_t k;
+        memcpy(&k, data, 4);
+        k *= m;
+        k ^= k >> 24;
+        k *= m;
+        h *= m;
+        h ^= k;
+        data += 4;
+        len -= 4;
+    }
+    switch (len) {
+    case 3:
+        h ^= data[2] << 16;
+        // fallthrough
+    case 2:
+        h ^= data[1] << 8;
+        // fallthrough
+    case 1:
+        h ^= data[0];
+        h *= m;
+    }
+
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+static int monitor_open(void) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                    NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // BPF_ABS loads are big endian, like the header fields
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct udev_header, magic)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, UDEV_MONITOR_MAGIC, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct udev_header, filter_subsystem_hash)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, murmurhash2("input"), 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    int on = 1, rcvbuf = 1024 * 1024;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        close(fd);
+        return -1;
+    }
+    // a plug storm shouldn't overflow the socket, not fatal if refused
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = UDEV_MONITOR_GROUP,
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads one uevent, returns the length of its NUL separated properties
+// (moved to the start of buf), 0 for messages to ignore, -1 once drained
+static ssize_t monitor_receive(int fd, char *buf, size_t size) {
+    struct sockaddr_nl addr;
+    char control[CMSG_SPACE(sizeof(struct ucred))];
+    // room for a terminating NUL
+    struct iovec iov = { .iov_base = buf, .iov_len = size - 1 };
+    struct msghdr msg = {
+        .msg_name = &addr,
+        .msg_namelen = sizeof(addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0) {
+        if (errno == ENOBUFS) {
+            fprintf(stderr, "uevents were dropped\n");
+            return 0;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("recvmsg");
+        }
+        return -1;
+    }
+
+    // Only udevd (running as root) multicasts on our group, anyone can
+    // unicast to us
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS || !addr.nl_groups) {
+        return 0;
+    }
+    struct ucred cred;
+    memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+    if (cred.uid != 0) {
+        return 0;
+    }
+
+    struct udev_header hdr;
+    if ((size_t)n < sizeof(hdr)) {
+        return 0;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (strcmp(hdr.prefix, "libudev") != 0 ||
+        ntohl(hdr.magic) != UDEV_MONITOR_MAGIC ||
+        hdr.properties_off > (size_t)n ||
+        hdr.properties_len > (size_t)n - hdr.properties_off) {
+        return 0;
+    }
+
+    memmove(buf, buf + hdr.properties_off, hdr.properties_len);
+    buf[hdr.properties_len] = '\0';
+    return hdr.properties_len;
+}
+
+static void read_sysfs_name(int id, char *name, size_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/input/event%d/device/name", id);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+    if (fgets(name, size, f)) {
+        name[strcspn(name, "\n")] = '\0';
+    }
+    fclose(f);
+}
+
+// NAME is only set on the inputN parent, which is added right before its
+// event nodes
+#define MAX_PARENTS 8
+
+struct parent_name {
+    char devpath[256];
+    char name[MAX_DEVICE_NAME];
+};
+
+static struct parent_name parents[MAX_PARENTS];
+static int next_parent;
+
+static void remember_parent(const char *devpath, const char *name) {
+    struct parent_name *p = &parents[next_parent++ % MAX_PARENTS];
+    // NAME="..."
+    size_t n = strlen(name);
+    if (n >= 2 && name[0] == '"' && name[n - 1] == '"') {
+        name++;
+        n -= 2;
+    }
+    snprintf(p->devpath, sizeof(p->devpath), "%s", devpath);
+    snprintf(p->name, sizeof(p->name), "%.*s", (int)n, name);
+}
+
+static const char *parent_name(const char *devpath) {
+    const char *slash = strrchr(devpath, '/');
+    if (!slash) {
+        return NULL;
+    }
+    size_t len = slash - devpath;
+    for (int i = 0; i < MAX_PARENTS; i++) {
+        if (strlen(parents[i].devpath) == len &&
+            strncmp(parents[i].devpath, devpath, len) == 0) {
+            return parents[i].name;
+        }
+    }
+    return NULL;
+}
+
+// Takes the NUL separated KEY=value properties of one uevent
+static void handle_uevent(struct hotplug *h, const char *props, size_t len,
+                          bool live) {
+    const char *action = NULL, *subsystem = NULL, *devname = NULL;
+    const char *devpath = NULL, *name = NULL;
+    bool keyboard = false;
+    for (const char *p = props; p < props + len; p += strlen(p) + 1) {
+        if (strncmp(p, "ACTION=", 7) == 0) {
+            action = p + 7;
+        } else if (strncmp(p, "SUBSYSTEM=", 10) == 0) {
+            subsystem = p + 10;
+        } else if (strncmp(p, "DEVPATH=", 8) == 0) {
+            devpath = p + 8;
+        } else if (strncmp(p, "DEVNAME=", 8) == 0) {
+            devname = p + 8;
+        } else if (strncmp(p, "NAME=", 5) == 0) {
+            name = p + 5;
+        } else if (strcmp(p, "ID_INPUT_KEYBOARD=1") == 0) {
+            keyboard = true;
+        }
+    }
+    if (!action || !subsystem || strcmp(subsystem, "input") != 0) {
+        return;
+    }
+    if (devpath && name && strcmp(action, "add") == 0) {
+        remember_parent(devpath, name);
+    }
+
+    // Every input device has an inputN parent and a node per handler, the
+    // evdev one is what compositors open
+    if (!devname || strncmp(devname, INPUT_EVENT_PREFIX,
+                            strlen(INPUT_EVENT_PREFIX)) != 0) {
+        return;
+    }
+    bool present;
+    if (strcmp(action, "add") == 0) {
+        present = true;
+    } else if (strcmp(action, "remove") == 0) {
+        present = false;
+    } else {
+        return;
+    }
+    if ((h->added_only && !present) || (h->keyboards_only && !keyboard)) {
+        return;
+    }
+
+    int id = atoi(devname + strlen(INPUT_EVENT_PREFIX));
+    TRACE(HP_UEVENT, id, trace_str(action));
+    struct device_change *dc = hotplug_event(h, id, present);
+    if (!dc || !present) {
+        return;
+    }
+    const char *parent = devpath ? parent_name(devpath) : NULL;
+    if (parent) {
+        snprintf(dc->name, sizeof(dc->name), "%s", parent);
+    } else if (live) {
+        read_sysfs_name(id, dc->name, sizeof(dc->name));
+    }
+}
+
+// Events recorded with `udevadm monitor --udev --property`, replayed with
+// their original spacing
+struct replay {
+    FILE *f;
+    bool eof;
+    uint64_t start_us;
+    double first_ts;
+
+    // the next event, due at start_us + (ts - first_ts)
+    double ts;
+    char props[UEVENT_SIZE];
+    size_t len;
+};
+
+static bool replay_next(struct replay *r) {
+    char line[1024];
+    bool in_event = false;
+    r->len = 0;
+
+    while (fgets(line, sizeof(line), r->f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!in_event) {
+            // UDEV  [1234.567890] add      /devices/... (input)
+            char *ts = strchr(line, '[');
+            if (strncmp(line, "UDEV ", 5) == 0 && ts) {
+                r->ts = strtod(ts + 1, NULL);
+                in_event = true;
+            }
+            continue;
+        }
+        if (!line[0]) {
+            return true;
+        }
+
+        size_t n = strlen(line) + 1;
+        if (r->len + n <= sizeof(r->props)) {
+            memcpy(r->props + r->len, line, n);
+            r->len += n;
+        }
+    }
+    return in_event;
+}
+
+static uint64_t replay_due_us(const struct replay *r) {
+    return r->start_us + (uint64_t)((r->ts - r->first_ts) * 1000000);
+}
+
+static bool parse_replay(int opt, char *arg, void *data) {
+    struct replay *r = data;
+    if (opt != 'r') {
+        return false;
+    }
+    r->f = fopen(arg, "r");
+    if (!r->f) {
+        perror(arg);
+        return false;
+    }
+    return true;
+}
+
+struct monitor {
+    struct evloop loop;
+    struct hotplug h;
+    struct replay replay;
+    int fd;
+    struct evloop_source source;
+};
+
+static void monitor_readable(void *data) {
+    struct monitor *m = data;
+    static char buf[UEVENT_SIZE];
+    ssize_t len;
+    while ((len = monitor_receive(m->fd, buf, sizeof(buf))) >= 0) {
+        handle_uevent(&m->h, buf, len, true);
+    }
+}
+
+// Feeds the recorded events that are due, quits once the last run is done
+static int replay_events(void *data) {
+    struct monitor *m = data;
+    struct replay *r = &m->replay;
+    uint64_t now = now_us();
+    while (!r->eof && replay_due_us(r) <= now) {
+        handle_uevent(&m->h, r->props, r->len, false);
+        r->eof = !replay_next(r);
+    }
+    if (!r->eof) {
+        return (replay_due_us(r) - now + 999) / 1000;
+    }
+    if (!m->h.deb.pending && !m->h.runner.pid) {
+        evloop_quit(&m->loop, 0);
+    }
+    return -1;
+}
+
+static void monitor_burst(struct hotplug *h, void *data) {
+    hotplug_run(h);
+}
+
+int main(int argc, char **argv) {
+    trace_init("udev-on-input-change");
+    static struct monitor m;
+    const struct hotplug_opts opts = {
+        .letters = "r:",
+        .synopsis = "[-r recording] ",
+        .help = "  -r  replay the events of `udevadm monitor --udev --property` output,\n"
+                "      then exit once the command is done\n",
+        .handle = parse_replay,
+        .data = &m.replay,
+    };
+    hotplug_parse_args(&m.h, argc, argv, true, &opts);
+    if (evloop_init(&m.loop) < 0) {
+        return 1;
+    }
+
+    if (m.replay.f) {
+        m.replay.eof = !replay_next(&m.replay);
+        m.replay.first_ts = m.replay.ts;
+        m.replay.start_us = now_us();
+        evloop_add_hook(&m.loop, replay_events, &m);
+        printf("Replaying uevents...\n");
+    } else {
+        m.fd = monitor_open();
+        if (m.fd < 0 ||
+            evloop_add(&m.loop, &m.source, m.fd, monitor_readable, &m) < 0) {
+            return 1;
+        }
+        printf("Listening for input uevents...\n");
+    }
+
+    if (hotplug_init(&m.h, &m.loop, monitor_burst, NULL) < 0) {
+        return 1;
+    }
+
+    printf("Will run:");
+    for (int i = 0; m.h.runner.argv[i]; i++) {
+        printf(" %s", m.h.runner.argv[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    return evloop_run(&m.loop);
+}
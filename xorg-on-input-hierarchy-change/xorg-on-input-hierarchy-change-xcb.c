@@ -0,0 +1,279 @@
+// XCB backend: runs the command on XI_HierarchyChanged like the Xlib one,
+// without the built-in config actions. Hierarchy events are decoded in place
+// from the reply buffer libxcb hands out, instead of being copied into an
+// XEvent and then into a separately allocated cookie.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <xcb/xcb.h>
+#include <xcb/xinput.h>
+
+#include "hotplug.h"
+#include "trace.h"
+
+// Same defaults as the Xlib backend, see there
+#define DEFAULT_FLAGS (XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED |   \
+                       XCB_INPUT_HIERARCHY_MASK_MASTER_REMOVED | \
+                       XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED |    \
+                       XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED |  \
+                       XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED)
+#define ADDED_FLAGS (XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED | \
+                     XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED |  \
+                     XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED)
+#define ADDED_ONLY_FLAGS (XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED | \
+                          XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED)
+
+static bool has_key_class(const xcb_input_xi_device_info_t *dev) {
+    xcb_input_device_class_iterator_t it =
+        xcb_input_xi_device_info_classes_iterator(dev);
+    for (; it.rem; xcb_input_device_class_next(&it)) {
+        if (it.data->type == XCB_INPUT_DEVICE_CLASS_TYPE_KEY) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_keyboard(xcb_connection_t *conn,
+                        const xcb_input_hierarchy_info_t *info) {
+    if (info->type == XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD ||
+        info->type == XCB_INPUT_DEVICE_TYPE_SLAVE_KEYBOARD) {
+        return true;
+    }
+    if (info->type != XCB_INPUT_DEVICE_TYPE_FLOATING_SLAVE ||
+        (info->flags & XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED)) {
+        return false;
+    }
+
+    // Floating slaves have no keyboard/pointer use, look at their classes
+    xcb_input_xi_query_device_reply_t *reply = xcb_input_xi_query_device_reply(
+        conn, xcb_input_xi_query_device(conn, info->deviceid), NULL);
+    if (!reply) {
+        return false;
+    }
+    xcb_input_xi_device_info_iterator_t it =
+        xcb_input_xi_query_device_infos_iterator(reply);
+    bool keyboard = it.rem && has_key_class(it.data);
+    free(reply);
+    return keyboard;
+}
+
+static void handle_hierarchy_event(xcb_connection_t *conn,
+                                   const xcb_input_hierarchy_event_t *ev,
+                                   struct hotplug *h) {
+    uint32_t filter = h->added_only ? ADDED_ONLY_FLAGS : DEFAULT_FLAGS;
+    const xcb_input_hierarchy_info_t *infos = xcb_input_hierarchy_infos(ev);
+    int n = xcb_input_hierarchy_infos_length(ev);
+
+    for (int i = 0; i < n; i++) {
+        const xcb_input_hierarchy_info_t *info = &infos[i];
+        uint32_t flags = info->flags & filter;
+        if (!flags) {
+            continue;
+        }
+        // Devices are added disabled and enabled right after, the enable
+        // event is the one to act on
+        if ((flags & ADDED_FLAGS) &&
+            !(flags & XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED) &&
+            !info->enabled &&
+            info->type != XCB_INPUT_DEVICE_TYPE_MASTER_POINTER &&
+            info->type != XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD) {
+            continue;
+        }
+        if (h->keyboards_only && !is_keyboard(conn, info)) {
+            continue;
+        }
+
+        TRACE(HP_XI_INFO, info->deviceid, info->flags);
+        hotplug_event(h, info->deviceid, flags & ADDED_FLAGS);
+    }
+}
+
+// One query for all devices, and the marker queries pipelined rather than
+// one round trip per device
+static void snapshot_devices(xcb_connection_t *conn, xcb_atom_t marker,
+                             struct device_set *set) {
+    set->count = 0;
+    xcb_input_xi_query_device_reply_t *reply = xcb_input_xi_query_device_reply(
+        conn, xcb_input_xi_query_device(conn, XCB_INPUT_DEVICE_ALL), NULL);
+    if (!reply) {
+        return;
+    }
+
+    xcb_input_xi_get_property_cookie_t cookies[MAX_DEVICES];
+    xcb_input_xi_device_info_iterator_t it =
+        xcb_input_xi_query_device_infos_iterator(reply);
+    for (; it.rem && set->count < MAX_DEVICES;
+         xcb_input_xi_device_info_next(&it)) {
+        const xcb_input_xi_device_info_t *dev = it.data;
+        if (dev->type == XCB_INPUT_DEVICE_TYPE_MASTER_POINTER ||
+            dev->type == XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD) {
+            continue;
+        }
+        cookies[set->count] = xcb_input_xi_get_property(
+            conn, dev->deviceid, 0, marker, XCB_GET_PROPERTY_TYPE_ANY, 0, 1);
+
+        struct device_state *d = &set->devices[set->count++];
+        d->id = dev->deviceid;
+        snprintf(d->name, sizeof(d->name), "%.*s",
+                 xcb_input_xi_device_info_name_length(dev),
+                 xcb_input_xi_device_info_name(dev));
+    }
+    free(reply);
+
+    for (int i = 0; i < set->count; i++) {
+        xcb_input_xi_get_property_reply_t *prop =
+            xcb_input_xi_get_property_reply(conn, cookies[i], NULL);
+        set->devices[i].marked = prop && prop->type != XCB_ATOM_NONE;
+        free(prop);
+    }
+}
+
+static void mark_devices(xcb_connection_t *conn, xcb_atom_t marker,
+                         const struct changes *c) {
+    uint8_t one = 1;
+    for (int i = 0; i < c->count; i++) {
+        if (c->devices[i].present) {
+            xcb_input_xi_change_property(conn, c->devices[i].id,
+                                         XCB_PROP_MODE_REPLACE, 8, marker,
+                                         XCB_ATOM_INTEGER, 1, &one);
+        }
+    }
+    xcb_flush(conn);
+}
+
+struct watch {
+    struct evloop loop;
+    struct hotplug h;
+    xcb_connection_t *conn;
+    uint8_t xi_opcode;
+    xcb_atom_t marker;
+    struct evloop_source source;
+};
+
+// Handles everything already read or readable without blocking
+static void watch_events(struct watch *w) {
+    xcb_generic_event_t *ev;
+    while ((ev = xcb_poll_for_event(w->conn))) {
+        const xcb_ge_generic_event_t *ge = (void *)ev;
+        TRACE(HP_XEVENT, ev->response_type & ~0x80, 0);
+        if ((ev->response_type & ~0x80) == XCB_GE_GENERIC &&
+            ge->extension == w->xi_opcode &&
+            ge->event_type == XCB_INPUT_HIERARCHY) {
+            handle_hierarchy_event(w->conn, (void *)ev, &w->h);
+        }
+        free(ev);
+    }
+    if (xcb_connection_has_error(w->conn)) {
+        fprintf(stderr, "Lost the X connection\n");
+        evloop_quit(&w->loop, 1);
+    }
+}
+
+static void watch_readable(void *data) {
+    watch_events(data);
+}
+
+// Replies waited for after a burst may have queued events
+static int watch_prepare(void *data) {
+    watch_events(data);
+    return -1;
+}
+
+static void watch_burst(struct hotplug *h, void *data) {
+    struct watch *w = data;
+    static struct device_set devices;
+    snapshot_devices(w->conn, w->marker, &devices);
+    if (hotplug_narrow(h, &devices)) {
+        mark_devices(w->conn, w->marker, &h->burst);
+        hotplug_run(h);
+    }
+}
+
+int main(int argc, char **argv) {
+    trace_init("xorg-on-input-hierarchy-change-xcb");
+    static struct watch w;
+    hotplug_parse_args(&w.h, argc, argv, true, NULL);
+
+    int screen_num;
+    xcb_connection_t *conn = xcb_connect(NULL, &screen_num);
+    w.conn = conn;
+    if (xcb_connection_has_error(conn)) {
+        fprintf(stderr, "Failed to open X display\n");
+        return 1;
+    }
+
+    const xcb_query_extension_reply_t *ext =
+        xcb_get_extension_data(conn, &xcb_input_id);
+    if (!ext || !ext->present) {
+        fprintf(stderr, "X Input extension not available.\n");
+        return 1;
+    }
+    w.xi_opcode = ext->major_opcode;
+
+    xcb_input_xi_query_version_reply_t *version =
+        xcb_input_xi_query_version_reply(
+            conn, xcb_input_xi_query_version(conn, 2, 2), NULL);
+    if (!version || version->major_version < 2) {
+        fprintf(stderr, "XI2 not supported. Server supports %d.%d\n",
+                version ? version->major_version : 0,
+                version ? version->minor_version : 0);
+        return 1;
+    }
+    free(version);
+
+    xcb_screen_iterator_t screens =
+        xcb_setup_roots_iterator(xcb_get_setup(conn));
+    for (int i = 0; i < screen_num; i++) {
+        xcb_screen_next(&screens);
+    }
+    xcb_window_t root = screens.data->root;
+
+    // Only XI_HierarchyChanged, so nothing else ever wakes us up
+    struct {
+        xcb_input_event_mask_t head;
+        uint32_t mask;
+    } evmask = {
+        .head = { .deviceid = XCB_INPUT_DEVICE_ALL, .mask_len = 1 },
+        .mask = XCB_INPUT_XI_EVENT_MASK_HIERARCHY,
+    };
+    xcb_generic_error_t *err = xcb_request_check(
+        conn, xcb_input_xi_select_events_checked(conn, root, 1, &evmask.head));
+    if (err) {
+        fprintf(stderr, "Failed to select XI_HierarchyChanged events\n");
+        free(err);
+        return 1;
+    }
+
+    xcb_intern_atom_reply_t *atom = xcb_intern_atom_reply(
+        conn,
+        xcb_intern_atom(conn, 0, strlen(APPLIED_MARKER), APPLIED_MARKER),
+        NULL);
+    if (!atom) {
+        fprintf(stderr, "Failed to intern %s\n", APPLIED_MARKER);
+        return 1;
+    }
+    w.marker = atom->atom;
+    free(atom);
+
+    if (evloop_init(&w.loop) < 0 ||
+        evloop_add(&w.loop, &w.source, xcb_get_file_descriptor(conn),
+                   watch_readable, &w) < 0 ||
+        evloop_add_hook(&w.loop, watch_prepare, &w) < 0 ||
+        hotplug_init(&w.h, &w.loop, watch_burst, &w) < 0) {
+        return 1;
+    }
+
+    printf("Listening for XI_HierarchyChanged events...\n");
+    printf("Will run:");
+    for (int i = 0; w.h.runner.argv[i]; i++) {
+        printf(" %s", w.h.runner.argv[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    int status = evloop_run(&w.loop);
+    xcb_disconnect(conn);
+    return status;
+}
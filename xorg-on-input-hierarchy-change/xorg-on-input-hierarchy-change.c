@@ -1,63 +1,654 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <sys/wait.h>
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/XKBlib.h>
 #include <X11/extensions/XInput2.h>
+#include <X11/extensions/XKBrules.h>
 
-#define DEBOUNCE_MS 64
-
-static void run_command(char **argv) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        execvp(argv[0], argv);
-        perror("execvp");
-        exit(1);
-    } else if (pid > 0) {
-        int status;
-        waitpid(pid, &status, 0);
+#include "config.h"
+#include "hotplug.h"
+#include "trace.h"
+#include "xorg-on-input-hierarchy-change.h"
+
+#define XKB_RULES_DIR "/usr/share/X11/xkb/rules"
+
+// Hierarchy changes that are worth a run by default. Attach/detach churn
+// between masters and slaves and explicit disables are not.
+#define DEFAULT_FLAGS (XIMasterAdded | XIMasterRemoved | XISlaveAdded | \
+                       XISlaveRemoved | XIDeviceEnabled)
+#define ADDED_FLAGS (XIMasterAdded | XISlaveAdded | XIDeviceEnabled)
+// -A
+#define ADDED_ONLY_FLAGS (XISlaveAdded | XIDeviceEnabled)
+
+static bool is_keyboard(Display *dpy, const XIHierarchyInfo *info) {
+    if (info->use == XIMasterKeyboard || info->use == XISlaveKeyboard) {
+        return true;
+    }
+    if (info->use != XIFloatingSlave || (info->flags & XISlaveRemoved)) {
+        return false;
+    }
+
+    // Floating slaves have no keyboard/pointer use, look at their classes
+    int n;
+    XIDeviceInfo *dev = XIQueryDevice(dpy, info->deviceid, &n);
+    bool keyboard = false;
+    for (int i = 0; dev && i < dev->num_classes; i++) {
+        if (dev->classes[i]->type == XIKeyClass) {
+            keyboard = true;
+        }
+    }
+    if (dev) {
+        XIFreeDeviceInfo(dev);
+    }
+    return keyboard;
+}
+
+// Records the changes of the event passing the filters
+static void handle_hierarchy_event(Display *dpy, XEvent *xev, int xi_opcode,
+                                   struct hotplug *h) {
+    if (xev->type != GenericEvent || xev->xgeneric.extension != xi_opcode) {
+        return;
+    }
+    if (!XGetEventData(dpy, &xev->xcookie)) {
+        return;
+    }
+
+    int filter = h->added_only ? ADDED_ONLY_FLAGS : DEFAULT_FLAGS;
+    if (xev->xcookie.evtype == XI_HierarchyChanged) {
+        XIHierarchyEvent *ev = xev->xcookie.data;
+        for (int i = 0; i < ev->num_info; i++) {
+            const XIHierarchyInfo *info = &ev->info[i];
+            int flags = info->flags & filter;
+            if (!flags) {
+                continue;
+            }
+            // Devices are added disabled and enabled right after, the enable
+            // event is the one to act on
+            if ((flags & ADDED_FLAGS) && !(flags & XIDeviceEnabled) &&
+                !info->enabled && info->use != XIMasterPointer &&
+                info->use != XIMasterKeyboard) {
+                continue;
+            }
+            if (h->keyboards_only && !is_keyboard(dpy, info)) {
+                continue;
+            }
+
+            TRACE(HP_XI_INFO, info->deviceid, info->flags);
+            hotplug_event(h, info->deviceid, flags & ADDED_FLAGS);
+        }
+    }
+
+    XFreeEventData(dpy, &xev->xcookie);
+}
+
+static bool is_marked(Display *dpy, Atom marker, int deviceid) {
+    Atom type;
+    int format;
+    unsigned long n, after;
+    unsigned char *data = NULL;
+    if (XIGetProperty(dpy, deviceid, marker, 0, 1, False, AnyPropertyType,
+                      &type, &format, &n, &after, &data) != Success) {
+        return false;
+    }
+    if (data) {
+        XFree(data);
+    }
+    return type != None;
+}
+
+// Returns the infos of all devices for the config actions, *n set to their
+// count, to be freed with XIFreeDeviceInfo
+static XIDeviceInfo *snapshot_devices(Display *dpy, Atom marker,
+                                      struct device_set *set, int *n) {
+    XIDeviceInfo *devs = XIQueryDevice(dpy, XIAllDevices, n);
+    set->count = 0;
+    for (int i = 0; devs && i < *n && set->count < MAX_DEVICES; i++) {
+        const XIDeviceInfo *dev = &devs[i];
+        if (dev->use == XIMasterPointer || dev->use == XIMasterKeyboard) {
+            continue;
+        }
+        struct device_state *d = &set->devices[set->count++];
+        d->id = dev->deviceid;
+        d->marked = is_marked(dpy, marker, dev->deviceid);
+        snprintf(d->name, sizeof(d->name), "%s", dev->name);
+    }
+    if (!devs) {
+        *n = 0;
+    }
+    return devs;
+}
+
+static void mark_devices(Display *dpy, Atom marker, const struct changes *c) {
+    unsigned char one = 1;
+    for (int i = 0; i < c->count; i++) {
+        if (c->devices[i].present) {
+            XIChangeProperty(dpy, c->devices[i].id, marker, XA_INTEGER, 8,
+                             PropModeReplace, &one, 1);
+        }
+    }
+}
+
+/*
+ * Built-in actions, applied on our own connection to devices added during a
+ * burst, instead of forking `xset` and `setxkbmap` which each open their own
+ * display connection.
+ *
+ * Config format (~/.config/xorg-on-input-hierarchy-change/config):
+ *   [keyboard]                  # all keyboards
+ *   repeat-delay = 200
+ *   repeat-rate = 40
+ *   layout = "us,ru"
+ *   options = "grp:caps_toggle"
+ *   [pointer]                   # all pointers
+ *   "libinput Accel Speed" = "-0.5"
+ *   [device "Logitech G502"]    # devices with this exact name
+ *   "libinput Accel Profile Enabled" = "0 1"
+ *
+ * Quoted keys are XInput device properties, values are separated by spaces
+ * or commas and converted to the property's type. Keyboard settings are
+ * rules/model/layout/variant/options (unset ones default to the current
+ * _XKB_RULES_NAMES) and repeat-delay (ms) / repeat-rate (per second).
+ *
+ * Applying them mostly sends requests without replies, flushed by a single
+ * XSync after the burst. What still waits for the server per device is
+ * listing its properties and loading the keymap; property types and values
+ * are resolved once per connection, and the device infos come from the
+ * snapshot of the burst.
+ */
+
+#define MAX_PROPS 16
+#define MAX_PROP_VALUES 32
+
+enum section_kind { SECTION_KEYBOARD, SECTION_POINTER, SECTION_DEVICE };
+
+struct prop_setting {
+    char *name;
+    char *value;
+    Atom atom;
+
+    // converted on the first device that has the property, per connection
+    bool resolved;
+    Atom type;
+    int format;
+    int n_values;
+    union {
+        int8_t i8[MAX_PROP_VALUES];
+        int16_t i16[MAX_PROP_VALUES];
+        // Xlib passes format 32 data as longs
+        long l[MAX_PROP_VALUES];
+    } values;
+};
+
+struct section {
+    enum section_kind kind;
+    char *device;
+
+    int repeat_delay;
+    int repeat_rate;
+
+    // RMLVO, and the keymap components resolved from it at load time
+    char *rules;
+    XkbRF_VarDefsRec rmlvo;
+    bool has_keymap;
+    XkbComponentNamesRec keymap;
+
+    struct prop_setting props[MAX_PROPS];
+    int n_props;
+
+    struct section *next;
+};
+
+// A quoted string or a bare word
+static char *parse_value(const char **p) {
+    if (**p == '"') {
+        return config_quoted(p);
+    }
+    const char *start = *p;
+    while (**p && **p != ' ' && **p != '\t' && **p != '#') {
+        (*p)++;
+    }
+    return *p > start ? strndup(start, *p - start) : NULL;
+}
+
+static bool section_set(struct section *s, const char *key, char *value) {
+    char **field = NULL;
+    if (strcmp(key, "repeat-delay") == 0) {
+        s->repeat_delay = atoi(value);
+    } else if (strcmp(key, "repeat-rate") == 0) {
+        s->repeat_rate = atoi(value);
+    } else if (strcmp(key, "rules") == 0) {
+        field = &s->rules;
+    } else if (strcmp(key, "model") == 0) {
+        field = &s->rmlvo.model;
+    } else if (strcmp(key, "layout") == 0) {
+        field = &s->rmlvo.layout;
+    } else if (strcmp(key, "variant") == 0) {
+        field = &s->rmlvo.variant;
+    } else if (strcmp(key, "options") == 0) {
+        field = &s->rmlvo.options;
     } else {
-        perror("fork");
+        return false;
+    }
+
+    if (field) {
+        free(*field);
+        *field = value;
+        s->has_keymap = true;
+    } else {
+        free(value);
+    }
+    return true;
+}
+
+static struct section *load_config(void) {
+    struct config_file cf;
+    if (!config_open(&cf, "xorg-on-input-hierarchy-change")) {
+        return NULL;
+    }
+
+    struct section *sections = NULL, **tail = &sections, *current = NULL;
+    const char *p;
+    while ((p = config_next(&cf))) {
+        // section header
+        if (*p == '[') {
+            current = calloc(1, sizeof(*current));
+            current->repeat_delay = current->repeat_rate = -1;
+            bool known = true;
+            if (strncmp(p, "[keyboard]", 10) == 0) {
+                current->kind = SECTION_KEYBOARD;
+            } else if (strncmp(p, "[pointer]", 9) == 0) {
+                current->kind = SECTION_POINTER;
+            } else if (strncmp(p, "[device ", 8) == 0) {
+                p += 8;
+                current->kind = SECTION_DEVICE;
+                current->device = config_quoted(&p);
+                known = current->device && *p == ']';
+            } else {
+                known = false;
+            }
+            // the settings up to the next valid header are dropped
+            if (!known) {
+                fprintf(stderr, "%s:%d: unknown section\n", cf.path,
+                        cf.lineno);
+                free(current->device);
+                free(current);
+                current = NULL;
+                continue;
+            }
+            *tail = current;
+            tail = &current->next;
+            continue;
+        }
+
+        if (!current) {
+            fprintf(stderr, "%s:%d: setting outside of a section\n", cf.path,
+                    cf.lineno);
+            continue;
+        }
+
+        // key = value, "property" = "values"
+        bool is_prop = *p == '"';
+        char *key;
+        if (is_prop) {
+            key = config_quoted(&p);
+        } else {
+            const char *start = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '=') {
+                p++;
+            }
+            key = strndup(start, p - start);
+        }
+
+        config_skip_blanks(&p);
+        char *value = NULL;
+        if (*p == '=') {
+            p++;
+            config_skip_blanks(&p);
+            value = parse_value(&p);
+        }
+        if (!key || !value) {
+            fprintf(stderr, "%s:%d: expected <key> = <value>\n", cf.path,
+                    cf.lineno);
+            free(key);
+            free(value);
+            continue;
+        }
+
+        if (is_prop && current->n_props < MAX_PROPS) {
+            struct prop_setting *prop = &current->props[current->n_props++];
+            prop->name = key;
+            prop->value = value;
+            continue;
+        }
+        if (is_prop || !section_set(current, key, value)) {
+            fprintf(stderr, "%s:%d: unknown setting %s\n", cf.path,
+                    cf.lineno, key);
+            free(value);
+        }
+        free(key);
+    }
+    return sections;
+}
+
+// Atoms differ between servers, and between runs of the same one
+static void intern_config_atoms(Display *dpy, struct section *sections) {
+    for (struct section *s = sections; s; s = s->next) {
+        for (int i = 0; i < s->n_props; i++) {
+            s->props[i].atom = XInternAtom(dpy, s->props[i].name, False);
+            s->props[i].resolved = false;
+        }
+    }
+}
+
+// Resolves keymaps, on the first connection to the display
+static void prepare_config(Display *dpy, struct section *sections) {
+    char *current_rules = NULL;
+    XkbRF_VarDefsRec current = {0};
+    XkbRF_GetNamesProp(dpy, &current_rules, &current);
+
+    for (struct section *s = sections; s; s = s->next) {
+        if (!s->has_keymap) {
+            continue;
+        }
+
+        // unset parts of RMLVO default to the current ones
+        if (!s->rules) {
+            s->rules = strdup(current_rules ? current_rules : "evdev");
+        }
+        if (!s->rmlvo.model && current.model) {
+            s->rmlvo.model = strdup(current.model);
+        }
+        if (!s->rmlvo.layout && current.layout) {
+            s->rmlvo.layout = strdup(current.layout);
+        }
+        if (!s->rmlvo.variant && current.variant) {
+            s->rmlvo.variant = strdup(current.variant);
+        }
+        if (!s->rmlvo.options && current.options) {
+            s->rmlvo.options = strdup(current.options);
+        }
+
+        char path[512];
+        if (s->rules[0] == '/') {
+            snprintf(path, sizeof(path), "%s", s->rules);
+        } else {
+            snprintf(path, sizeof(path), XKB_RULES_DIR "/%s", s->rules);
+        }
+
+        XkbRF_RulesPtr rules = XkbRF_Load(path, "", False, True);
+        if (!rules || !XkbRF_GetComponents(rules, &s->rmlvo, &s->keymap)) {
+            fprintf(stderr, "Unable to resolve the keymap with rules %s\n",
+                    path);
+            s->has_keymap = false;
+        }
+        if (rules) {
+            XkbRF_Free(rules, True);
+        }
+    }
+
+    free(current_rules);
+    free(current.model);
+    free(current.layout);
+    free(current.variant);
+    free(current.options);
+}
+
+// Takes the property's type and format from a device that has it, and
+// converts the values once
+static bool resolve_prop(Display *dpy, Atom float_atom, int deviceid,
+                         struct prop_setting *prop) {
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char *data = NULL;
+    if (XIGetProperty(dpy, deviceid, prop->atom, 0, 0, False, AnyPropertyType,
+                      &type, &format, &nitems, &after, &data) != Success) {
+        return false;
+    }
+    if (data) {
+        XFree(data);
+    }
+    if (type == None) {
+        return false;
+    }
+
+    prop->type = type;
+    prop->format = format;
+    prop->n_values = 0;
+    if (type == XA_STRING) {
+        prop->resolved = true;
+        return true;
+    }
+
+    int n = 0;
+    char *copy = strdup(prop->value), *save, *token;
+    for (token = strtok_r(copy, " ,", &save); token && n < MAX_PROP_VALUES;
+         token = strtok_r(NULL, " ,", &save), n++) {
+        if (type == float_atom && format == 32) {
+            float f = strtof(token, NULL);
+            // FLOAT is 32 bits on the wire, stored in a long by Xlib
+            prop->values.l[n] = 0;
+            memcpy(&prop->values.l[n], &f, sizeof(f));
+        } else if (type == XA_ATOM && format == 32) {
+            prop->values.l[n] = XInternAtom(dpy, token, False);
+        } else if (format == 8) {
+            prop->values.i8[n] = strtol(token, NULL, 0);
+        } else if (format == 16) {
+            prop->values.i16[n] = strtol(token, NULL, 0);
+        } else {
+            prop->values.l[n] = strtol(token, NULL, 0);
+        }
+    }
+    free(copy);
+    prop->n_values = n;
+    prop->resolved = true;
+    return true;
+}
+
+static void set_device_prop(Display *dpy, Atom float_atom, int deviceid,
+                            struct prop_setting *prop) {
+    if (!prop->resolved && !resolve_prop(dpy, float_atom, deviceid, prop)) {
+        return;
+    }
+
+    if (prop->type == XA_STRING) {
+        XIChangeProperty(dpy, deviceid, prop->atom, prop->type, 8,
+                         PropModeReplace, (unsigned char *)prop->value,
+                         strlen(prop->value));
+        return;
+    }
+    XIChangeProperty(dpy, deviceid, prop->atom, prop->type, prop->format,
+                     PropModeReplace, (unsigned char *)&prop->values,
+                     prop->n_values);
+}
+
+// Properties are only set on devices that have them, as setting one would
+// create it otherwise
+static bool has_prop(const Atom *props, int n, Atom atom) {
+    for (int i = 0; i < n; i++) {
+        if (props[i] == atom) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void apply_section(Display *dpy, Atom float_atom, struct section *s,
+                          const XIDeviceInfo *dev, bool keyboard,
+                          const Atom *props, int n_props) {
+    if (keyboard && s->has_keymap) {
+        XkbDescPtr xkb = XkbGetKeyboardByName(
+            dpy, dev->deviceid, (XkbComponentNamesPtr)&s->keymap,
+            XkbGBN_AllComponentsMask,
+            XkbGBN_AllComponentsMask & ~XkbGBN_GeometryMask, True);
+        if (xkb) {
+            XkbFreeKeyboard(xkb, XkbAllComponentsMask, True);
+        } else {
+            fprintf(stderr, "Unable to load the keymap on %s\n", dev->name);
+        }
+    }
+
+    if (keyboard && (s->repeat_delay >= 0 || s->repeat_rate > 0)) {
+        unsigned int delay, interval;
+        // only a partial setting needs the current one
+        if (s->repeat_delay < 0 || s->repeat_rate <= 0) {
+            XkbGetAutoRepeatRate(dpy, dev->deviceid, &delay, &interval);
+        }
+        if (s->repeat_delay >= 0) {
+            delay = s->repeat_delay;
+        }
+        if (s->repeat_rate > 0) {
+            interval = 1000 / s->repeat_rate;
+        }
+        XkbSetAutoRepeatRate(dpy, dev->deviceid, delay, interval);
+    }
+
+    for (int i = 0; i < s->n_props; i++) {
+        if (has_prop(props, n_props, s->props[i].atom)) {
+            set_device_prop(dpy, float_atom, dev->deviceid, &s->props[i]);
+        }
     }
 }
 
-static bool is_hierarchy_event(XEvent *xev, int xi_opcode) {
-    if (xev->type == GenericEvent && xev->xgeneric.extension == xi_opcode) {
-        XGetEventData(xev->xgeneric.display, &xev->xcookie);
-        if (xev->xcookie.evtype == XI_HierarchyChanged) {
-            XFreeEventData(xev->xgeneric.display, &xev->xcookie);
+static bool has_key_class(const XIDeviceInfo *dev) {
+    for (int i = 0; i < dev->num_classes; i++) {
+        if (dev->classes[i]->type == XIKeyClass) {
             return true;
         }
-        XFreeEventData(xev->xgeneric.display, &xev->xcookie);
     }
     return false;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <command> [args...]\n", argv[0]);
-        return 1;
+static bool section_matches(const struct section *s, const XIDeviceInfo *dev,
+                            bool keyboard, bool pointer) {
+    return (s->kind == SECTION_KEYBOARD && keyboard) ||
+           (s->kind == SECTION_POINTER && pointer) ||
+           (s->kind == SECTION_DEVICE && (keyboard || pointer) &&
+            strcmp(s->device, dev->name) == 0);
+}
+
+static void apply_device(Display *dpy, Atom float_atom,
+                         struct section *sections, const XIDeviceInfo *dev) {
+    bool keyboard = dev->use == XISlaveKeyboard ||
+                    (dev->use == XIFloatingSlave && has_key_class(dev));
+    bool pointer = dev->use == XISlavePointer ||
+                   (dev->use == XIFloatingSlave && !has_key_class(dev));
+
+    // one request for the properties the device has, if any are set
+    int n_props = 0;
+    Atom *props = NULL;
+    for (const struct section *s = sections; s && !props; s = s->next) {
+        if (s->n_props && section_matches(s, dev, keyboard, pointer)) {
+            props = XIListProperties(dpy, dev->deviceid, &n_props);
+            if (!props) {
+                break;
+            }
+        }
     }
 
-    Display *dpy = XOpenDisplay(NULL);
+    for (struct section *s = sections; s; s = s->next) {
+        if (section_matches(s, dev, keyboard, pointer)) {
+            TRACE(HP_APPLY, dev->deviceid, trace_str(dev->name));
+            apply_section(dpy, float_atom, s, dev, keyboard, props, n_props);
+        }
+    }
+
+    if (props) {
+        XFree(props);
+    }
+}
+
+// Config errors on a device (e.g. a bad property value) must not be fatal
+static int on_x_error(Display *dpy, XErrorEvent *err) {
+    char msg[256];
+    XGetErrorText(dpy, err->error_code, msg, sizeof(msg));
+    fprintf(stderr, "X error: %s (request %d.%d)\n", msg, err->request_code,
+            err->minor_code);
+    return 0;
+}
+
+#define RECONNECT_MS 1000
+
+// A watched display. Its connection comes and goes, the hotplug state and a
+// running command survive reconnects.
+struct display {
+    const char *name; // NULL for $DISPLAY
+    Display *dpy;     // NULL while disconnected
+    bool lost;
+    uint64_t retry_us;
+
+    int xi_opcode;
+    Atom float_atom;
+    Atom marker;
+    struct section *config;
+    bool config_prepared;
+
+    struct hotplug h;
+    // for -D name=command
+    char *sh_argv[4];
+
+    struct evloop *loop;
+    struct evloop_source source;
+};
+
+static struct display displays[MAX_DISPLAYS];
+static int n_displays;
+
+// Called instead of exit() when the connection breaks, the display is
+// closed and reopened from the main loop
+static void on_io_error_exit(Display *dpy, void *data) {
+    struct display *d = data;
+    fprintf(stderr, "Lost X display %s\n", DisplayString(dpy));
+    TRACE(HP_DISCONNECT, trace_str(DisplayString(dpy)), 0);
+    d->lost = true;
+}
+
+static void display_readable(void *data);
+
+static bool display_connect(struct display *d) {
+    Display *dpy = XOpenDisplay(d->name);
     if (!dpy) {
-        fprintf(stderr, "Failed to open X display\n");
-        return 1;
+        fprintf(stderr, "Failed to open X display %s\n",
+                XDisplayName(d->name));
+        return false;
     }
 
-    int xi_opcode, event, error;
-    if (!XQueryExtension(dpy, "XInputExtension", &xi_opcode, &event, &error)) {
+    int event, error;
+    if (!XQueryExtension(dpy, "XInputExtension", &d->xi_opcode, &event,
+                         &error)) {
         fprintf(stderr, "X Input extension not available.\n");
-        return 1;
+        XCloseDisplay(dpy);
+        return false;
     }
 
     int major = 2, minor = 2;
     if (XIQueryVersion(dpy, &major, &minor) != Success) {
         fprintf(stderr, "XI2 not supported. Server supports %d.%d\n", major, minor);
-        return 1;
+        XCloseDisplay(dpy);
+        return false;
     }
 
+    int xkb_opcode, xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+    if (!XkbQueryExtension(dpy, &xkb_opcode, &event, &error, &xkb_major,
+                           &xkb_minor)) {
+        fprintf(stderr, "XKB extension not available.\n");
+        XCloseDisplay(dpy);
+        return false;
+    }
+
+    XSetIOErrorExitHandler(dpy, on_io_error_exit, d);
+    if (!d->config_prepared) {
+        prepare_config(dpy, d->config);
+        d->config_prepared = true;
+    }
+    intern_config_atoms(dpy, d->config);
+    d->float_atom = XInternAtom(dpy, "FLOAT", False);
+    d->marker = XInternAtom(dpy, APPLIED_MARKER, False);
+
     Window root = DefaultRootWindow(dpy);
 
     XIEventMask evmask;
@@ -70,50 +661,210 @@ int main(int argc, char **argv) {
     XISelectEvents(dpy, root, &evmask, 1);
     XFlush(dpy);
 
-    printf("Listening for XI_HierarchyChanged events...\n");
-    printf("Will run:");
-    for (int i = 1; i < argc; i++) {
-        printf(" %s", argv[i]);
+    d->dpy = dpy;
+    d->lost = false;
+    evloop_add(d->loop, &d->source, ConnectionNumber(dpy), display_readable,
+               d);
+    TRACE(HP_CONNECT, trace_str(DisplayString(dpy)), 0);
+    // stdout may be another module's output in desktop-eventd
+    fprintf(stderr, "Listening for XI_HierarchyChanged events on %s...\n",
+            DisplayString(dpy));
+    return true;
+}
+
+static void display_disconnect(struct display *d) {
+    evloop_remove(d->loop, &d->source);
+    XCloseDisplay(d->dpy);
+    d->dpy = NULL;
+    d->h.burst.count = 0;
+    d->retry_us = now_us() + RECONNECT_MS * 1000;
+}
+
+// A display (re)appearing is like all its devices being plugged in at once
+static void queue_all_devices(struct display *d) {
+    int n;
+    XIDeviceInfo *devs = XIQueryDevice(d->dpy, XIAllDevices, &n);
+    for (int i = 0; i < n; i++) {
+        const XIDeviceInfo *dev = &devs[i];
+        bool keyboard = dev->use == XISlaveKeyboard ||
+                        (dev->use == XIFloatingSlave && has_key_class(dev));
+        if (dev->use == XIMasterPointer || dev->use == XIMasterKeyboard ||
+            !dev->enabled || (d->h.keyboards_only && !keyboard)) {
+            continue;
+        }
+        hotplug_event(&d->h, dev->deviceid, true);
+    }
+    if (devs) {
+        XIFreeDeviceInfo(devs);
     }
-    printf("\n");
+}
 
-    bool pending = false;
+static void display_burst(struct hotplug *h, void *data) {
+    struct display *d = data;
+    static struct device_set devices;
+    if (!d->dpy) {
+        d->h.burst.count = 0;
+        return;
+    }
 
-    while (1) {
-        XEvent xev;
+    int n;
+    XIDeviceInfo *devs = snapshot_devices(d->dpy, d->marker, &devices, &n);
+    if (!hotplug_narrow(&d->h, &devices)) {
+        if (devs) {
+            XIFreeDeviceInfo(devs);
+        }
+        return;
+    }
 
-        if (!pending) {
-            // Blocking wait for the first event
-            XNextEvent(dpy, &xev);
-            fprintf(stderr, "Received event, type: %d\n", xev.type);
-            if (is_hierarchy_event(&xev, xi_opcode)) {
-                pending = true;
+    for (int i = 0; d->config && i < d->h.burst.count; i++) {
+        const struct device_change *dc = &d->h.burst.devices[i];
+        for (int j = 0; dc->present && j < n; j++) {
+            if (devs[j].deviceid == dc->id) {
+                apply_device(d->dpy, d->float_atom, d->config, &devs[j]);
             }
         }
+    }
+    if (devs) {
+        XIFreeDeviceInfo(devs);
+    }
+    // everything above that needs no reply goes out with this round trip
+    mark_devices(d->dpy, d->marker, &d->h.burst);
+    XSync(d->dpy, False);
+
+    hotplug_run(&d->h);
+}
 
-        if (pending) {
-            fprintf(stderr, "Debouncing for %d ms\n", DEBOUNCE_MS);
-            // Sleep for debounce timeout
-            usleep(DEBOUNCE_MS * 1000);
+struct display_names {
+    char *names[MAX_DISPLAYS];
+    int count;
+};
 
+static bool parse_display(int opt, char *arg, void *data) {
+    struct display_names *d = data;
+    if (opt != 'D' || d->count == MAX_DISPLAYS) {
+        return false;
+    }
+    d->names[d->count++] = arg;
+    return true;
+}
 
-            int drained = 0;
-            // Drain all pending events from the queue
-            while (XPending(dpy) > 0) {
-                XNextEvent(dpy, &xev);
-                drained++;
-                // Just discard - we already know we need to run the command
+// Handles everything already read or readable without blocking
+static void display_events(struct display *d) {
+    while (!d->lost && XPending(d->dpy) > 0) {
+        XEvent xev;
+        XNextEvent(d->dpy, &xev);
+        TRACE(HP_XEVENT, xev.type, 0);
+        handle_hierarchy_event(d->dpy, &xev, d->xi_opcode, &d->h);
+    }
+    if (d->lost) {
+        display_disconnect(d);
+    }
+}
+
+static void display_readable(void *data) {
+    struct display *d = data;
+    if (d->dpy) {
+        display_events(d);
+    }
+}
+
+// Reconnects displays that are due, and handles events Xlib queued while
+// waiting for replies
+static int displays_prepare(void *data) {
+    int timeout = -1;
+    uint64_t now = now_us();
+    for (int i = 0; i < n_displays; i++) {
+        struct display *d = &displays[i];
+        if (!d->dpy && now >= d->retry_us) {
+            if (display_connect(d)) {
+                queue_all_devices(d);
+            } else {
+                d->retry_us = now + RECONNECT_MS * 1000;
+            }
+        }
+        if (d->dpy) {
+            display_events(d);
+        }
+        if (!d->dpy) {
+            int ms = (d->retry_us - now + 999) / 1000;
+            if (timeout < 0 || ms < timeout) {
+                timeout = ms;
             }
+        }
+    }
+    return timeout;
+}
+
+int xorg_input_start(struct evloop *loop, int argc, char **argv) {
+    if (n_displays) {
+        fprintf(stderr, "%s can only be started once\n", argv[0]);
+        return -1;
+    }
 
-            fprintf(stderr, "Drained %d events\n", drained);
-            fprintf(stderr, "Executing command\n");
+    struct hotplug common = {0};
+    struct display_names dn = {0};
+    const struct hotplug_opts opts = {
+        .letters = "D:",
+        .synopsis = "[-D display[=command]]... ",
+        .help = "  -D  watch this display instead of $DISPLAY, repeatable; with =command,\n"
+                "      run this shell command for it instead of the common one\n",
+        .handle = parse_display,
+        .data = &dn,
+    };
+    // the command is optional when the config has actions
+    hotplug_parse_args(&common, argc, argv, false, &opts);
+    char **names = dn.names;
+    int count = dn.count;
+    bool multi = count > 0;
+    if (!multi) {
+        names[count++] = NULL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct display *d = &displays[i];
+        d->h = common;
+        d->name = names[i];
+        d->loop = loop;
+
+        char *command = names[i] ? strchr(names[i], '=') : NULL;
+        if (command) {
+            *command++ = '\0';
+            d->sh_argv[0] = "/bin/sh";
+            d->sh_argv[1] = "-c";
+            d->sh_argv[2] = command;
+            d->h.runner.argv = d->sh_argv;
+        }
+        // each one gets its own copy, atoms are per server
+        d->config = load_config();
+        if (!d->h.runner.argv && !d->config) {
+            hotplug_usage(argv[0], true);
+        }
+        d->h.runner.display = d->name;
+
+        if (hotplug_init(&d->h, loop, display_burst, d) < 0) {
+            return -1;
+        }
+        if (d->h.runner.argv) {
+            fprintf(stderr, "Will run for %s:", XDisplayName(d->name));
+            for (int j = 0; d->h.runner.argv[j]; j++) {
+                fprintf(stderr, " %s", d->h.runner.argv[j]);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+    n_displays = count;
 
-            // Run the command
-            run_command(&argv[1]);
-            pending = false;
+    XSetErrorHandler(on_x_error);
+    for (int i = 0; i < n_displays; i++) {
+        if (display_connect(&displays[i])) {
+            continue;
+        }
+        // a single $DISPLAY has to be there at startup, -D ones may come later
+        if (!multi) {
+            return -1;
         }
+        displays[i].retry_us = now_us() + RECONNECT_MS * 1000;
     }
 
-    XCloseDisplay(dpy);
-    return 0;
+    return evloop_add_hook(loop, displays_prepare, NULL);
 }
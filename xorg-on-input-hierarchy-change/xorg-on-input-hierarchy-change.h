@@ -0,0 +1,11 @@
+#ifndef XORG_ON_INPUT_HIERARCHY_CHANGE_H
+#define XORG_ON_INPUT_HIERARCHY_CHANGE_H
+
+#include "evloop.h"
+
+// Parses the options like the standalone binary (exits with the usage on
+// errors), connects the displays and registers with the loop. Returns -1 on
+// errors, which are printed. Can only be started once per process.
+int xorg_input_start(struct evloop *loop, int argc, char **argv);
+
+#endif